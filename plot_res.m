@@ -2,14 +2,40 @@
 clc; clearvars ; close all;
 format long
 NC = 400; 
-data=importdata('results.dat');
+binary = false; % set true for results.bin (BINARY_OUTPUT in sheath_steady.cpp)
+averages = false; % set true to plot the time averaged profiles of averages.dat (average=true)
+phase_space = false; % set true to plot the last record of phase_space.bin (phase_space=true)
+particles = ''; % particle dump to plot, e.g. 'particles_00010000.bin' (particle_interval)
+xrange = [0 inf]; % x range of the particles read from it
 n=NC+1;
 
-for i=1:length(data(:,1))/n;    
-    x=data((i-1)*n+1:i*n,1);
-    ndi=data((i-1)*n+1:i*n,2);
-    nde=data((i-1)*n+1:i*n,3);    
-    phi=data((i-1)*n+1:i*n,7);
+if binary
+    fid=fopen('results.bin','r');
+    magic=fread(fid,8,'char=>char')';
+    hdr=fread(fid,3,'int32');
+    n=hdr(2); nfields=hdr(3);
+    names=fread(fid,[16 nfields],'char=>char')';
+    x=fread(fid,n,'double');
+    rec=fread(fid,[1+nfields*n inf],'double');
+    fclose(fid);
+    ndump=size(rec,2);
+else
+    data=importdata('results.dat');
+    ndump=length(data(:,1))/n;
+end
+
+for i=1:ndump;    
+    if binary
+        fields=reshape(rec(2:end,i),n,nfields);
+        ndi=fields(:,1);
+        nde=fields(:,2);
+        phi=fields(:,6);
+    else
+        x=data((i-1)*n+1:i*n,1);
+        ndi=data((i-1)*n+1:i*n,2);
+        nde=data((i-1)*n+1:i*n,3);    
+        phi=data((i-1)*n+1:i*n,7);
+    end
     
     figure(1)
     plot(x,ndi,'linewidth',2),grid on
@@ -19,4 +45,88 @@ for i=1:length(data(:,1))/n;
     pause(0.1)    
 end
 
+if averages
+    % one block of n lines per averaging window: x, then mean and std of
+    % ndi, nde, veli, vele, phi, ef
+    avg=importdata('averages.dat');
+    nwin=length(avg(:,1))/n;
+    last=avg((nwin-1)*n+1:nwin*n,:);
+    
+    figure(2)
+    errorbar(last(:,1),last(:,10),last(:,11)),grid on
+    xlabel('x'),ylabel('Time averaged potential')
+    title(nwin)
+end
+
+if phase_space
+    fid=fopen('phase_space.bin','r');
+    magic=fread(fid,8,'char=>char')';
+    hdr=fread(fid,5,'int32');
+    ns=hdr(2); nx=hdr(3); nv=hdr(4); nreg=hdr(5);
+    xr=fread(fid,2,'double');
+    regions=fread(fid,[2 nreg],'double');
+    for s=1:ns
+        spname{s}=deblank(fread(fid,32,'char=>char')');
+        vr(:,s)=fread(fid,2,'double');
+    end
+    % records: time (double), then per species the nx*nv histogram (x major)
+    % and nreg velocity distributions of nv bins, in single precision
+    nrec=0;
+    while true
+        t=fread(fid,1,'double');
+        if isempty(t), break; end
+        vals=fread(fid,(nx+nreg)*nv*ns,'single');
+        nrec=nrec+1;
+    end
+    fclose(fid);
+    
+    xc=xr(1)+((1:nx)-0.5)*(xr(2)-xr(1))/nx;
+    for s=1:ns
+        h=vals((s-1)*(nx+nreg)*nv+1:s*(nx+nreg)*nv);
+        vc=vr(1,s)+((1:nv)-0.5)*(vr(2,s)-vr(1,s))/nv;
+        figure(2+s)
+        subplot(2,1,1)
+        imagesc(xc,vc,reshape(h(1:nx*nv),nv,nx)),axis xy,colorbar
+        xlabel('x'),ylabel('v'),title([spname{s} ' phase space'])
+        if nreg>0
+            % log scale: a Maxwellian is a parabola, its e-folding gives the temperature
+            subplot(2,1,2)
+            semilogy(vc,reshape(h(nx*nv+1:end),nv,nreg)),grid on
+            xlabel('v'),ylabel('f(v)')
+            legend(arrayfun(@(r) sprintf('%g-%g m',regions(1,r),regions(2,r)),1:nreg,'UniformOutput',false))
+        end
+    end
+end
 
+if ~isempty(particles)
+    fid=fopen(particles,'r');
+    magic=fread(fid,8,'char=>char')';
+    hdr=fread(fid,4,'int32');
+    ns=hdr(2); prec=sprintf('float%d',8*hdr(3));
+    t=fread(fid,1,'double');
+    nchunks=fread(fid,2,'int64');
+    for s=1:ns
+        spname{s}=deblank(fread(fid,32,'char=>char')');
+        props(:,s)=fread(fid,3,'double');   % spwt, mass, charge
+        sp_index(:,s)=fread(fid,3,'int64');    % count, first chunk, chunks
+    end
+    for c=1:nchunks(1)
+        ids=fread(fid,2,'int32');
+        xr=fread(fid,2,'double');
+        chunk(c)=struct('s',ids(1)+1,'n',ids(2),'xmin',xr(1),'xmax',xr(2),'offset',fread(fid,1,'int64'));
+    end
+    % only the chunks overlapping xrange are read
+    for s=1:ns
+        x=[]; v=[];
+        for c=find([chunk.s]==s & [chunk.xmax]>=xrange(1) & [chunk.xmin]<=xrange(2))
+            fseek(fid,chunk(c).offset,'bof');
+            x=[x; fread(fid,chunk(c).n,prec)];
+            v=[v; fread(fid,chunk(c).n,prec)];
+        end
+        keep=x>=xrange(1) & x<=xrange(2);
+        figure(10+s)
+        plot(x(keep),v(keep),'.','markersize',1),grid on
+        xlabel('x'),ylabel('v'),title([spname{s} sprintf(' particles at t=%g',t)])
+    end
+    fclose(fid);
+end
@@ -23,18 +23,194 @@ The code objectives:
 # include <cmath>
 # include <cstdlib>
 # include <vector>
-# include <list>
 # include <ctime>
-# include <random>
+# include <cstdint>
+# include <cstddef>
+# include <climits>
 # include <cstring>
+# include <string>
+# include <fstream>
+# include <sstream>
+# include <thread>
+# include <mutex>
+# include <condition_variable>
+# include <atomic>
+# include <new>
+# include <chrono>
+# include <map>
+# include <algorithm>
+# include <csignal>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# ifdef _OPENMP
+# include <omp.h>
+# endif
+# ifdef PICS_MPI
+# include <mpi.h>
+# endif
+# if defined(PICS_DEVICE) && !defined(_OPENMP)
+# error "-DPICS_DEVICE offloads with OpenMP target regions, build with -fopenmp"
+# endif
 using namespace std;
 
-/* Random Number Generator */
-std::mt19937 mt_gen(0);
-std::uniform_real_distribution<double> rnd_dist(0,1.0);
+/* Serial stand-ins for the OpenMP runtime calls*/
+#ifndef _OPENMP
+inline int omp_get_max_threads(){return 1;}
+inline int omp_get_num_threads(){return 1;}
+inline int omp_get_thread_num(){return 0;}
+#endif
+
+/* Random Number Generator: one stream per thread, so runs are reproducible 
+for a fixed seed and number of threads. A stream interleaves LANES xoshiro256++ 
+generators, each 2^128 draws (one jump) ahead of the previous one, so bulk 
+fills vectorize across the lanes. Single draws come from a buffered batch*/
+inline uint64_t Rotl(uint64_t x, int k) {return (x<<k) | (x>>(64-k));}
+
+class alignas(64) RandomStream
+{
+public:
+	static const int LANES = 8;
+	static const int BATCH = 256;
+	
+	// Set the state of one lane
+	void SetLane(int l, const uint64_t *state)
+	{
+		for(int k=0; k<4; k++) s[k][l] = state[k];
+		next = BATCH;
+		has_spare = false;
+	}
+	
+	// n uniform deviates in [0,1)
+	void Fill(double *u, int n)
+	{
+		for(int k=0; k<n; k+=LANES)
+		{
+			double r[LANES];
+			#pragma omp simd
+			for(int l=0; l<LANES; l++)
+			{
+				uint64_t result = Rotl(s[0][l]+s[3][l], 23) + s[0][l];
+				uint64_t t = s[1][l] << 17;
+				s[2][l] ^= s[0][l];
+				s[3][l] ^= s[1][l];
+				s[1][l] ^= s[2][l];
+				s[0][l] ^= s[3][l];
+				s[2][l] ^= t;
+				s[3][l] = Rotl(s[3][l], 45);
+				r[l] = (int64_t)(result>>11)*0x1.0p-53;
+			}
+			int m = min(LANES, n-k);
+			for(int l=0; l<m; l++) u[k+l] = r[l];
+		}
+	}
+	
+	// n standard normal deviates, Box-Muller on pairs of uniforms
+	void FillNormal(double *g, int n)
+	{
+		double u[BATCH];
+		for(int k=0; k<n; k+=BATCH)
+		{
+			int m = min(BATCH, n-k);
+			int pairs = (m+1)/2;
+			Fill(u, 2*pairs);
+			for(int j=0; j<pairs; j++)
+			{
+				double r = sqrt(-2*log(1-u[2*j]));
+				double theta = 2*M_PI*u[2*j+1];
+				g[k+2*j] = r*cos(theta);
+				if(2*j+1<m) g[k+2*j+1] = r*sin(theta);
+			}
+		}
+	}
+	
+	double Uniform()
+	{
+		if(next==BATCH)
+		{
+			Fill(buf, BATCH);
+			next = 0;
+		}
+		return buf[next++];
+	}
+	
+	double Normal()
+	{
+		if(has_spare)
+		{
+			has_spare = false;
+			return spare;
+		}
+		double r = sqrt(-2*log(1-Uniform()));
+		double theta = 2*M_PI*Uniform();
+		spare = r*sin(theta);
+		has_spare = true;
+		return r*cos(theta);
+	}
+	
+private:
+	uint64_t s[4][LANES];  // xoshiro256++ state of each lane
+	double buf[BATCH];     // batch of uniforms for the single draws
+	int next = BATCH;
+	double spare;          // second deviate of the last Box-Muller pair
+	bool has_spare = false;
+};
+
+vector<RandomStream> rng_streams(1);
 double rnd()
 {
-	return rnd_dist(mt_gen);
+	return rng_streams[omp_get_thread_num()].Uniform();
+}
+
+/* Seed the streams: the first lane starts from splitmix64 of the seed, every 
+further lane (of this and the following streams) one jump ahead. The streams 
+before first_stream belong to other MPI ranks and are skipped*/
+void InitRandomStreams(int num_threads, unsigned int seed, int first_stream=0)
+{
+	static const uint64_t JUMP[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 
+		0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+	uint64_t state[4];
+	uint64_t x = seed;
+	for(int k=0; k<4; k++)
+	{
+		uint64_t z = (x += 0x9e3779b97f4a7c15);
+		z = (z ^ (z>>30))*0xbf58476d1ce4e5b9;
+		z = (z ^ (z>>27))*0x94d049bb133111eb;
+		state[k] = z ^ (z>>31);
+	}
+	
+	rng_streams.assign(num_threads, RandomStream());
+	for(int t=0; t<first_stream+num_threads; t++)
+		for(int l=0; l<RandomStream::LANES; l++)
+		{
+			if(t>=first_stream) rng_streams[t-first_stream].SetLane(l, state);
+			
+			/*jump ahead by 2^128 draws*/
+			uint64_t jumped[4] = {0,0,0,0};
+			for(int w=0; w<4; w++)
+				for(int b=0; b<64; b++)
+				{
+					if(JUMP[w] & ((uint64_t)1<<b))
+						for(int k=0; k<4; k++) jumped[k] ^= state[k];
+					uint64_t tmp = state[1] << 17;
+					state[2] ^= state[0];
+					state[3] ^= state[1];
+					state[1] ^= state[2];
+					state[0] ^= state[3];
+					state[2] ^= tmp;
+					state[3] = Rotl(state[3], 45);
+				}
+			for(int k=0; k<4; k++) state[k] = jumped[k];
+		}
+}
+
+/* Split [0,n) into contiguous chunks, one per thread of the enclosing team*/
+void ThreadRange(int n, int *start, int *end)
+{
+	int nt = omp_get_num_threads();
+	int t = omp_get_thread_num();
+	*start = (int)((long)n*t/nt);
+	*end = (int)((long)n*(t+1)/nt);
 }
 
 
@@ -47,29 +223,261 @@ const double AMU = 1.660538921E-27;
 const double EV_TO_K = 11604.52;
 const double pi = 3.14159265359;
 
-/* Define Simulation Parameters*/
-const double PLASMA_DEN = 1E16; // Plasma Density
-const double DX = 1E-4;         // Cell Spacing 
-const double DT = 5E-11;		// Time steps 
-const double ELECTRON_TEMP = 2; // electron temperature in eV
-const double ION_TEMP = 0.1;  // ion temperature in eV
+/* Define Simulation Parameters (defaults, set from the input deck)*/
+double PLASMA_DEN = 1E16; // Plasma Density
+double DX = 1E-4;         // Cell Spacing 
+double DT = 5E-11;		// Time steps 
+double ELECTRON_TEMP = 2; // electron temperature in eV
+double ION_TEMP = 0.1;  // ion temperature in eV
+int ION_SUBCYCLE = 1;   // ion push interval in time steps (built-in species)
+
+int NUM_IONS = 30000;      // Number of simulation ions
+int NUM_ELECTRONS = 80000; // Number of simulation electrons
+int NC =  400;             // Total number of cells
+double MESH_STRETCH = 1;   // middle to wall cell width ratio of the mesh, 1: uniform
+int NUM_TS = 10000;          // Total time steps 
+int SEED = 0;              // Random number seed
+
+/* Define Output Parameters*/
+int DIAG_INTERVAL = 200;     // time steps between diagnostic dumps
+bool BINARY_OUTPUT = false;  // write results.bin/ke.bin instead of the .dat text files
+int FLUSH_INTERVAL = 0;      // flush every FLUSH_INTERVAL dumps, 0: only at the end of the run
+int OUTPUT_BUFFER = 1<<20;   // stdio buffer size of the output files in bytes
+bool ASYNC_OUTPUT = true;    // serialize the diagnostics on a background thread
+string OUTPUT_PREFIX = "";   // prepended to the output file names
+string PUSH_KERNEL = "auto"; // push kernel: auto, scalar, avx2 or avx512
+bool TIMING = true;          // write per-phase timings to timing.jsonl
+
+/* Define Field Solver Parameters*/
+string FIELD_SOLVER = "direct"; // direct (Thomas), gs (Gauss-Seidel), multigrid or pcr
+double MG_TOL = 1e-8;        // multigrid stops when a V-cycle changes phi by less than this, relative
+int MG_MAX_CYCLES = 50;      // multigrid V-cycles per solve
+int MG_SWEEPS = 2;           // smoothing sweeps before and after each coarse correction
+
+/* Define Electron Model Parameters*/
+bool BOLTZMANN_ELECTRONS = false; // electrons as a Boltzmann fluid at electron_temp instead of particles
+int BOLTZMANN_RELAX = 1000;  // time steps over which the ion wall flux setting the electron density is averaged
+double NEWTON_TOL = 1e-10;   // Newton iterations stop when phi changes by less than this times electron_temp
+int NEWTON_MAX_ITER = 50;    // Newton iterations per solve
+
+/* Define Phase Space Parameters*/
+bool PHASE_SPACE = false;    // bin (x,v) histograms of the species into phase_space.bin
+int PS_NX = 100;             // position bins over the domain
+int PS_NV = 100;             // velocity bins, also used by the region distributions
+double PS_VMAX = 10;         // velocity range +-ps_vmax thermal speeds, unless the species sets vmax
+int PS_STRIDE = 10;          // time steps between samples, averaged up to each dump
+string VDF_REGIONS = "";     // velocity distributions over x ranges, as fractions of the 
+                             // domain, e.g. "0.45:0.55,0.95:1"
+
+/* Define Collision Parameters*/
+bool MCC = false;              // Monte Carlo collisions with a uniform neutral background
+double NEUTRAL_DEN = 1e21;     // neutral density (m^-3)
+double NEUTRAL_TEMP = 0.026;   // neutral temperature in eV
+double NEUTRAL_MASS = 40;      // neutral mass in amu (ions of about this mass collide as Ar+ on Ar)
+string XS_E_ELASTIC = "";      // cross section files (energy in eV, cross section in m^2 per line), 
+string XS_I_ELASTIC = "";      // empty: built-in approximate argon data
+string XS_I_CX = "";
+
+/* Define Particle Sorting Parameters*/
+int SORT_INTERVAL = 0;       // time steps between sorts of the particles by cell, 0: off
+bool SORT_AUTO = false;      // stretch the interval of each species while it stays ordered
+double SORT_DISORDER = 0.1;  // disorder the tuned interval aims at
+int SORT_INTERVAL_MAX = 1000;
+
+/* Define Source Parameters*/
+bool SOURCE = false;         // refill the particles lost to the walls each time step
+double SOURCE_XMIN = 0.25;   // source region, as fractions of the domain length
+double SOURCE_XMAX = 0.75;
+
+/* Define Steady State Parameters*/
+int STEADY_CHECK = 0;          // time steps between detector samples, 0: detector off
+int STEADY_WINDOW = 20;        // samples compared by the detector
+double STEADY_TOL = 0.02;      // relative drift below which the run is steady
+string STEADY_ACTION = "stop"; // on steady state: stop, average, or report and continue
+bool ADAPTIVE_DIAG = false;    // stretch the dump interval while nothing changes
+int DIAG_INTERVAL_MAX = 6400;  // longest dump interval with adaptive_diag
+
+/* Define Averaging Parameters*/
+bool AVERAGE = false;        // accumulate time averaged field profiles in averages.dat
+int AVERAGE_START = 0;       // first time step accumulated
+int AVERAGE_WINDOW = 0;      // time steps per averaging window, 0: one window to the end
+int AVERAGE_STRIDE = 1;      // time steps between samples
+bool SNAPSHOTS = true;       // write the instantaneous profiles to results.dat
+int PARTICLE_INTERVAL = 0;   // time steps between raw particle dumps (particles_<ts>.bin), 0: none
+int PARTICLE_CHUNK = 65536;  // particles per chunk of the particle dumps
+
+/* Define Validation Parameters*/
+string VALIDATE = "";        // averages file of a reference (all double) run to compare with
+double VALIDATE_TOL = 0.05;  // largest relative L2 difference of the ndi, nde and phi profiles
+
+/* Define Checkpoint Parameters*/
+int CHECKPOINT_INTERVAL = 0;        // time steps between checkpoints, 0: only on SIGTERM
+string CHECKPOINT_FILE = "checkpoint.bin"; // written with the output prefix
+string RESTART = "";                // checkpoint file to restart from
+
+/* Define Ensemble Parameters*/
+int ENSEMBLE = 0;            // independent realizations advanced as one batch, 0: a single run
+string ENSEMBLE_PARAM = "";  // parameter the members differ in (plasma_den, electron_temp, 
+                             // ion_temp, num_ions, num_electrons), empty: the seed
+string ENSEMBLE_VALUES = ""; // its value for each member, separated by commas
+
+/* Define Device Parameters*/
+bool DEVICE = false;         // run the main loop on the offload device (builds with -DPICS_DEVICE)
+
+/* Define Monitor Parameters*/
+string MONITOR_SHM = "";     // shared memory ring buffer for live viewers, e.g. /pics, empty: off
+int MONITOR_INTERVAL = 10;   // time steps between records while a viewer is attached
+int MONITOR_NODES = 128;     // nodes sampled from the profiles
+int MONITOR_SLOTS = 64;      // records kept in the ring
+bool MONITOR_VIEW = false;   // attach to monitor_shm and print its records instead of running
+
+/* Define Benchmark Parameters*/
+bool BENCHMARK = false;      // run the kernel benchmarks instead of a simulation
+int BENCH_NP_MIN = 10000;    // particle count sweep, in decades
+int BENCH_NP_MAX = 100000000;
+int BENCH_NC_MIN = 400;      // grid size sweep, in decades
+int BENCH_NC_MAX = 1000000;
+int BENCH_GS_NC_MAX = 400;   // largest grid for the Gauss-Seidel solver
+int BENCH_REPS = 5;          // timed repetitions per kernel
+string BENCH_REF = "bench_ref.dat"; // reference checksums of the scalar code
+bool BENCH_WRITE_REF = false; // write BENCH_REF from this run instead of checking against it
+int SHAPE_ORDER = 1;         // particle shape: 0 NGP, 1 CIC (linear), 2 TSC
+
+/* Class Arena: One block of memory, aligned to the 64 byte cache lines, for 
+the field arrays and the scratch buffers of a run. It is sized from the grid at 
+setup and hands out cleared chunks of whole cache lines, so every array starts 
+aligned for the SIMD loops and the copies of different threads never share a 
+line. The chunks live until Release(), the time steps allocate nothing*/
+class Arena
+{
+public:
+	static const size_t ALIGN = 64;
+	
+	// Bytes of a chunk of n values of T, rounded up to whole cache lines
+	template<class T> static size_t Bytes(size_t n) {return (n*sizeof(T)+ALIGN-1)/ALIGN*ALIGN;}
+	
+	void Init(size_t bytes)
+	{
+		Release();
+		capacity = Bytes<char>(bytes>0?bytes:1);
+		base = (char*)aligned_alloc(ALIGN, capacity);
+		if(!base)
+		{
+			printf("Arena: can not allocate %zu bytes\n", capacity);
+			exit(-1);
+		}
+		memset(base, 0, capacity);
+	}
+	
+	// Cleared chunk of n values of T; running out is a sizing error
+	template<class T> T *Take(size_t n)
+	{
+		size_t bytes = Bytes<T>(n);
+		if(used+bytes>capacity)
+		{
+			printf("Arena: %zu bytes requested with %zu of %zu left\n", bytes, capacity-used, capacity);
+			exit(-1);
+		}
+		T *chunk = (T*)(base+used);
+		used += bytes;
+		return chunk;
+	}
+	
+	void Release()
+	{
+		free(base);
+		base = NULL;
+		capacity = used = 0;
+	}
+	
+	size_t Capacity() {return capacity;}
+	size_t Used() {return used;}
+	
+private:
+	char *base = NULL;
+	size_t capacity = 0, used = 0;
+};
+
+/* Heap allocation counter of builds with -DPICS_ALLOC_COUNT: the replaced 
+operators new count every allocation, scalar, array and over-aligned, so a run 
+can check that its time steps allocate nothing after setup. Every form takes 
+its memory from CountedAlloc and returns it to CountedFree, so each delete 
+matches its new. Without the flag it stays 0*/
+std::atomic<long> heap_allocations(0);
+#ifdef PICS_ALLOC_COUNT
+__attribute__((noinline)) void *CountedAlloc(size_t bytes, size_t align, bool nothrow)
+{
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	if(bytes==0) bytes = 1;
+	void *p = align>alignof(std::max_align_t)?aligned_alloc(align, (bytes+align-1)/align*align):malloc(bytes);
+	if(!p && !nothrow) throw std::bad_alloc();
+	return p;
+}
+__attribute__((noinline)) void CountedFree(void *p) noexcept {free(p);}
+
+void *operator new(size_t bytes) {return CountedAlloc(bytes, 0, false);}
+void *operator new[](size_t bytes) {return CountedAlloc(bytes, 0, false);}
+void *operator new(size_t bytes, std::align_val_t al) {return CountedAlloc(bytes, (size_t)al, false);}
+void *operator new[](size_t bytes, std::align_val_t al) {return CountedAlloc(bytes, (size_t)al, false);}
+void *operator new(size_t bytes, const std::nothrow_t&) noexcept {return CountedAlloc(bytes, 0, true);}
+void *operator new[](size_t bytes, const std::nothrow_t&) noexcept {return CountedAlloc(bytes, 0, true);}
+void *operator new(size_t bytes, std::align_val_t al, const std::nothrow_t&) noexcept {return CountedAlloc(bytes, (size_t)al, true);}
+void *operator new[](size_t bytes, std::align_val_t al, const std::nothrow_t&) noexcept {return CountedAlloc(bytes, (size_t)al, true);}
 
-const int NUM_IONS = 30000;      // Number of simulation ions
-const int NUM_ELECTRONS = 80000; // Number of simulation electrons
-const int NC =  400;             // Total number of cells
-const int NUM_TS = 10000;          // Total time steps 
+void operator delete(void *p) noexcept {CountedFree(p);}
+void operator delete[](void *p) noexcept {CountedFree(p);}
+void operator delete(void *p, size_t) noexcept {CountedFree(p);}
+void operator delete[](void *p, size_t) noexcept {CountedFree(p);}
+void operator delete(void *p, std::align_val_t) noexcept {CountedFree(p);}
+void operator delete[](void *p, std::align_val_t) noexcept {CountedFree(p);}
+void operator delete(void *p, size_t, std::align_val_t) noexcept {CountedFree(p);}
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {CountedFree(p);}
+void operator delete(void *p, const std::nothrow_t&) noexcept {CountedFree(p);}
+void operator delete[](void *p, const std::nothrow_t&) noexcept {CountedFree(p);}
+void operator delete(void *p, std::align_val_t, const std::nothrow_t&) noexcept {CountedFree(p);}
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t&) noexcept {CountedFree(p);}
+#endif
+
+/* Cell lookup of a stretched mesh: the bin of a position gives the cell 
+holding the start of the bin, and the position is in it or the next one. A 
+plain copy, so the particle loops can keep it in registers*/
+struct MeshLookup
+{
+	const double *xn = NULL, *inv_h = NULL; // node positions, inverse cell widths
+	const int *bin_cell = NULL;
+	int nbins = 0;
+	double x0 = 0, inv_bin = 0;             // start and inverse width of the bins
+	
+	inline double ToL(double pos) const
+	{
+		int b = (int)((pos-x0)*inv_bin);
+		b = b<0?0:(b<nbins?b:nbins-1);
+		int j = bin_cell[b];
+		j += (pos>=xn[j+1]);
+		return j + (pos-xn[j])*inv_h[j];
+	}
+};
 
 /* Class Domain: Hold the domain parameters*/
 class Domain
 {
 public:	
-	int ni;      // Number of nodes
+	int ni;      // Number of nodes (of the rank and its ghosts, when decomposed)
+	int ng;      // nodes of the whole domain
 	double x0;   // initial position 
 	double dx;   // cell spacing
-	double xl;   // domain length
+	double xl;   // length of the whole domain
 	double xmax; // domain maximum position
 	
-	/* Field Data structures */
+	/* Stretched mesh (mesh_stretch>1), dx is then the mean cell spacing*/
+	bool uniform = true;
+	vector<double> xn;       // node positions
+	vector<double> inv_h;    // inverse cell widths
+	vector<double> volume;   // node volumes, half cells at the walls
+	vector<int> bin_cell;    // cell holding the start of each lookup bin
+	MeshLookup lookup;       // the tables, for the particle loops
+	
+	/* Field Data structures, in the arena */
 	double *phi; // Electric Potential
 	double *ef;  // Electric field
 	double *rho; // Charge Density 
@@ -79,6 +487,15 @@ public:
 	double *vele; // Electron Velocity			
 };
 
+/* Precision of the particle positions and velocities. Build with -DPICS_SINGLE 
+for single precision particles, which halves the particle memory traffic; the 
+fields, the deposits and the field solve stay in double*/
+#ifdef PICS_SINGLE
+typedef float PartReal;
+#else
+typedef double PartReal;
+#endif
+
 /* Class Particle: Hold particle position, velocity and particle identity*/
 class Particle
 {
@@ -91,12 +508,186 @@ public:
 	Particle(double x, double v):pos(x), vel(v){};
 };
 
+/* Class ParticleArray: Hold the particles of a species in contiguous
+(structure of arrays) storage, so the particle loops stream through memory.
+The storage works as a pool: removed particles free the slot at the end of 
+the arrays and new particles fill it again, the capacity is never released, 
+so removing and injecting particles does not allocate once reserved*/
+class ParticleArray
+{
+public:
+	vector<PartReal> pos; // particle positions
+	vector<PartReal> vel; // particle velocities
+	vector<int> id;     // particle identities
+	vector<unsigned char> flag; // scratch mask of particles to be removed
+	
+	// scratch for the sort by cell, kept between sorts: the particle sized 
+	// arrays grow with the pool, the per thread cell counts (cell_start, 
+	// threads by cells) come from the arena
+	vector<PartReal> pos_sorted, vel_sorted;
+	vector<int> id_sorted, cell;
+	int *cell_start = NULL;
+	
+	// Arena bytes of cell_start for nc cells
+	static size_t SortScratchBytes(int nc) {return Arena::Bytes<int>((size_t)omp_get_max_threads()*nc);}
+	
+	int size() const {return (int)pos.size();}
+	
+	void reserve(int n)
+	{
+		pos.reserve(n);
+		vel.reserve(n);
+		id.reserve(n);
+		flag.reserve(n);
+	}
+	
+	void resize(int n)
+	{
+		pos.resize(n);
+		vel.resize(n);
+		id.resize(n);
+	}
+	
+	void push_back(const Particle &part)
+	{
+		pos.push_back(part.pos);
+		vel.push_back(part.vel);
+		id.push_back(part.id);
+	}
+	
+	// Remove particle p by moving the last particle into its slot
+	void remove(int p)
+	{
+		int last = size()-1;
+		pos[p] = pos[last];
+		vel[p] = vel[last];
+		id[p] = id[last];
+		pos.pop_back();
+		vel.pop_back();
+		id.pop_back();
+	}
+	
+	// Counting sort of the particles by cell index (nc cells of width dx from 
+	// x0), stable and parallel over thread chunks. Returns the disorder before 
+	// the sort, the fraction of particles more than a cache line of grid 
+	// (8 nodes) away from their predecessor (0 sorted, near 1 random); below 
+	// min_disorder the particles are left in place
+	double sort_by_cell(double x0, double dx, int nc, double min_disorder)
+	{
+		int np = size();
+		if(np<2) return 0;
+		long jumps = count_cells(x0, dx, nc);
+		double disorder = (double)jumps/(np-1);
+		if(disorder<min_disorder) return disorder;
+		cell_offsets(nc);
+		
+		pos_sorted.reserve(pos.capacity());
+		vel_sorted.reserve(vel.capacity());
+		id_sorted.reserve(id.capacity());
+		pos_sorted.resize(np);
+		vel_sorted.resize(np);
+		id_sorted.resize(np);
+		#pragma omp parallel
+		{
+			int *next = &cell_start[(size_t)omp_get_thread_num()*nc];
+			int start, end;
+			ThreadRange(np, &start, &end);
+			for(int p=start; p<end; p++)
+			{
+				int dst = next[cell[p]]++;
+				pos_sorted[dst] = pos[p];
+				vel_sorted[dst] = vel[p];
+				id_sorted[dst] = id[p];
+			}
+		}
+		pos.swap(pos_sorted);
+		vel.swap(vel_sorted);
+		id.swap(id_sorted);
+		return disorder;
+	}
+	
+	// The order of the same sort, as indices of the particles, which stay in place
+	void order_by_cell(double x0, double dx, int nc, vector<int> &order)
+	{
+		int np = size();
+		order.resize(np);
+		count_cells(x0, dx, nc);
+		cell_offsets(nc);
+		#pragma omp parallel
+		{
+			int *next = &cell_start[(size_t)omp_get_thread_num()*nc];
+			int start, end;
+			ThreadRange(np, &start, &end);
+			for(int p=start; p<end; p++)
+				order[next[cell[p]]++] = p;
+		}
+	}
+	
+	// Remove all particles with a non-zero flag, keeping the flags in step
+	void remove_flagged()
+	{
+		int p = 0;
+		while(p<size())
+		{
+			if(flag[p])
+			{
+				flag[p] = flag[size()-1];
+				remove(p);
+			}
+			else
+				p++;
+		}
+	}
+	
+private:
+	// Cell of each particle and per thread counts of each cell, returns 
+	// the number of jumps of more than 8 cells between successive particles
+	long count_cells(double x0, double dx, int nc)
+	{
+		int np = size();
+		cell.reserve(pos.capacity());
+		cell.resize(np);
+		memset(cell_start, 0, sizeof(int)*omp_get_max_threads()*nc);
+		long jumps = 0;
+		
+		#pragma omp parallel reduction(+:jumps)
+		{
+			int t = omp_get_thread_num();
+			int *count = &cell_start[(size_t)t*nc];
+			int start, end;
+			ThreadRange(np, &start, &end);
+			for(int p=start; p<end; p++)
+			{
+				int c = max(0, min(nc-1, (int)((pos[p]-x0)/dx)));
+				cell[p] = c;
+				count[c]++;
+				if(p>start && abs(c-cell[p-1])>8) jumps++;
+			}
+		}
+		return jumps;
+	}
+	
+	// exclusive prefix sum in (cell, thread) order keeps the sort stable
+	void cell_offsets(int nc)
+	{
+		int nt = omp_get_max_threads();
+		int offset = 0;
+		for(int c=0; c<nc; c++)
+			for(int t=0; t<nt; t++)
+			{
+				int n = cell_start[(size_t)t*nc+c];
+				cell_start[(size_t)t*nc+c] = offset;
+				offset += n;
+			}
+	}
+};
+
 /* Class Species: Hold species data*/
 class Species
 {	
 public:
-	// Use linked list for the particles
-	list<Particle> part_list;	
+	// Use contiguous arrays for the particles
+	ParticleArray part_list;	
 	double mass;
 	double charge;
 	double spwt;
@@ -104,12 +695,31 @@ public:
 	int NUM; 
 	double Temp;
 	
+	vector<double> den; // number density
+	vector<double> vel; // velocity moment (flux)
+	
+	// Subcycling: the species is pushed every subcycle steps with 
+	// subcycle*DT, in the field averaged over those steps (summed in ef_sum). 
+	// Its moments are held between pushes
+	int subcycle = 1;
+	vector<double> ef_sum;
+	
+	double vmax = 0; // phase space velocity range, 0: from the temperature
+	
 	void add(Particle part)
 	{
 		part.id=part_id++; 
 		part_list.push_back(part);
 	}	
 	
+	// Reserve n consecutive particle ids, returns the first one
+	int add_ids(int n)
+	{
+		int first = part_id;
+		part_id += n;
+		return first;
+	}
+	
 	// Add a constructor
 	Species(string name, double mass, double charge, double spwt, int NUM, double Temp)
 	{
@@ -119,6 +729,7 @@ public:
 		setSpwt(spwt);
 		setNum(NUM);
 		setTemp(Temp);
+		part_list.reserve(NUM);
 	}	
 	
 	// Define the constructor functions
@@ -129,486 +740,5800 @@ public:
 	void setNum (int NUM){this->NUM = NUM;}
 	void setTemp(double Temp){this->Temp = Temp;}
 	
+	// Next particle id, saved and restored by the checkpoints
+	int getPartId(){return part_id;}
+	void setPartId(int part_id){this->part_id = part_id;}
+	
 private:
 	int part_id = 0;	
 };
 
 // Define Domain and File as the global variable
+Arena arena;
 Domain domain;
 FILE *file_res;
 FILE *file_ke;
+FILE *file_avg = NULL;
+FILE *file_ps = NULL;
+FILE *file_ens = NULL;
 
-// Define Helper functions
-void Init(Species *species);
-void ScatterSpecies(Species *species, double *field); 
-void ScatterSpeciesVel(Species *species, double *field);
-void ComputeRho(Species *ions, Species *electrons);
-void ComputeEF(double *phi, double *ef);
-void PushSpecies(Species *species, double *ef);
-void RewindSpecies(Species *species, double *ef);
-void Write_ts(int ts);
-void Write_Particle(Species *species);
-void WriteKE(double Time, Species *ions, Species *electrons);
+/* Particle shape functions: Gather interpolates a field to the logical 
+coordinate lc and Scatter deposits a value from it. The order is a template 
+parameter, so the weights are inlined and constant folded inside the particle 
+loops (and the push loop still vectorizes). ScatterAtomic is the deposit of 
+the device kernels (-DPICS_DEVICE), where all particles share one grid*/
+#ifdef PICS_DEVICE
+#pragma omp declare target
+#endif
+template<int ORDER> struct Shape;
 
-double ComputeKE(Species *species); 
-double XtoL(double pos);
-double gather(double lc, double *field);
-double SampleVel(double T, double mass);
+/* Nearest grid point*/
+template<> struct Shape<0>
+{
+	static inline double Gather(double lc, const double *field, int /*ni*/)
+	{
+		return field[(int)(lc+0.5)];
+	}
+	static inline void Scatter(double lc, double value, double *field, int /*ni*/)
+	{
+		field[(int)(lc+0.5)] += value;
+	}
+#ifdef PICS_DEVICE
+	static inline void ScatterAtomic(double lc, double value, double *field, int /*ni*/)
+	{
+		#pragma omp atomic
+		field[(int)(lc+0.5)] += value;
+	}
+#endif
+};
 
-bool SolvePotential(double *phi, double *rho);
-bool SolvePotentialDirect(double *phi, double *rho);
+/* Cloud in cell (linear)*/
+template<> struct Shape<1>
+{
+	static inline double Gather(double lc, const double *field, int /*ni*/)
+	{
+		int i = (int)lc;
+		double di = lc-i;
+		return field[i]*(1-di) + field[i+1]*(di);
+	}
+	static inline void Scatter(double lc, double value, double *field, int /*ni*/)
+	{
+		int i = (int)lc;
+		double di = lc-i;
+		field[i] += value*(1-di);
+		field[i+1] += value*(di);
+	}
+#ifdef PICS_DEVICE
+	static inline void ScatterAtomic(double lc, double value, double *field, int /*ni*/)
+	{
+		int i = (int)lc;
+		double di = lc-i;
+		#pragma omp atomic
+		field[i] += value*(1-di);
+		#pragma omp atomic
+		field[i+1] += value*(di);
+	}
+#endif
+};
 
-/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
-/********************* MAIN FUNCTION ***************************/
-int main()
-{	
-	double Time = 0;
-	/*Construct the domain parameters*/	
-	domain.ni = NC+1;
-	domain.dx = DX;
-	domain.x0 = 0;
-	domain. xl = (domain.ni-1)*domain.dx;
-	domain.xmax = domain.x0 + domain.xl;
-	
-	/*Allocate memory to the domain data structures (Field variables)*/
-	domain.phi = new double[domain.ni];
-	domain.ef = new double[domain.ni];
-	domain.rho = new double[domain.ni];
-	domain.nde = new double[domain.ni];
-	domain.ndi = new double[domain.ni];
-	domain.veli = new double[domain.ni];
-	domain.vele = new double[domain.ni];
+/* Triangular shaped cloud (quadratic), centred on the nearest node. Weights 
+beyond the walls are folded back onto the wall nodes*/
+template<> struct Shape<2>
+{
+	static inline double Gather(double lc, const double *field, int ni)
+	{
+		int j = (int)(lc+0.5);
+		double d = lc-j;
+		int jm = j>0?j-1:0;
+		int jp = j<ni-1?j+1:ni-1;
+		return field[jm]*0.5*(0.5-d)*(0.5-d) + field[j]*(0.75-d*d) + field[jp]*0.5*(0.5+d)*(0.5+d);
+	}
+	static inline void Scatter(double lc, double value, double *field, int ni)
+	{
+		int j = (int)(lc+0.5);
+		double d = lc-j;
+		int jm = j>0?j-1:0;
+		int jp = j<ni-1?j+1:ni-1;
+		field[jm] += value*0.5*(0.5-d)*(0.5-d);
+		field[j] += value*(0.75-d*d);
+		field[jp] += value*0.5*(0.5+d)*(0.5+d);
+	}
+#ifdef PICS_DEVICE
+	static inline void ScatterAtomic(double lc, double value, double *field, int ni)
+	{
+		int j = (int)(lc+0.5);
+		double d = lc-j;
+		int jm = j>0?j-1:0;
+		int jp = j<ni-1?j+1:ni-1;
+		#pragma omp atomic
+		field[jm] += value*0.5*(0.5-d)*(0.5-d);
+		#pragma omp atomic
+		field[j] += value*(0.75-d*d);
+		#pragma omp atomic
+		field[jp] += value*0.5*(0.5+d)*(0.5+d);
+	}
+#endif
+};
+#ifdef PICS_DEVICE
+#pragma omp end declare target
+#endif
+
+/* Call FUNC<ORDER>(...) for the shape order of the run*/
+#define SHAPE_DISPATCH(FUNC, ...) \
+	switch(SHAPE_ORDER) \
+	{ \
+	case 0: FUNC<0>(__VA_ARGS__); break; \
+	case 2: FUNC<2>(__VA_ARGS__); break; \
+	default: FUNC<1>(__VA_ARGS__); break; \
+	}
+
+/* Species definition read from the input deck*/
+struct SpeciesInput
+{
+	string name;
+	double mass;   // kg
+	double charge; // C
+	int num;
+	double temp;   // eV
+	int subcycle = 1; // push interval in time steps
+	double vmax = 0;  // phase space velocity range (m/s), 0: ps_vmax thermal speeds
+};
+
+/* Class FieldSolver: Poisson solver behind one interface. The direct (Thomas) 
+solver factors the tridiagonal matrix once, since it only depends on the grid 
+and the boundary types, and each solve only does the forward/back substitution 
+on rho. Gauss-Seidel and multigrid iterate from the phi passed in, so the 
+previous time step is the warm start. Parallel cyclic reduction solves the same 
+tridiagonal system as the direct solver in log2(ni) parallel sweeps*/
+class FieldSolver
+{
+public:
+	enum BCType {DIRICHLET, NEUMANN};
+	enum Side {LEFT=0, RIGHT=1};
+	enum Method {DIRECT, GS, MULTIGRID, PCR};
 	
-	/*Redifine the field variables */
-	double *phi = domain.phi;
-	double *ef = domain.ef;
-	double *rho = domain.rho;
-	double *nde = domain.nde;
-	double *ndi = domain.ndi;
-	double *veli = domain.veli;
-	double *vele = domain.vele;
-	
-	/* Clear the domain fields*/
-	memset(phi,0,sizeof(double)*domain.ni);
-	memset(ef, 0,sizeof(double)*domain.ni);
-	memset(rho,0,sizeof(double)*domain.ni);
-	memset(nde,0,sizeof(double)*domain.ni);
-	memset(ndi,0,sizeof(double)*domain.ni);
-	memset(veli,0,sizeof(double)*domain.ni);
-	memset(vele,0,sizeof(double)*domain.ni);
-	/**************************************************/
-		
-	/*Species Info: Create vector to hold the data*/
-	vector <Species> species_list;
+	// Look up a method by name (direct, gs, multigrid, pcr), false if unknown
+	static bool MethodFromName(const string &name, Method *method);
+	void SetMethod(Method method){this->method = method;}
+	int Iterations() {return iterations;}
 	
-	/*Calculate the specific weights of the ions and electrons*/
-	double ion_spwt = (PLASMA_DEN*domain.xl)/(NUM_IONS);
-	double electron_spwt = (PLASMA_DEN*domain.xl)/(NUM_ELECTRONS);
+	// Set up the grid and factor with grounded (phi=0) walls, the 
+	// coefficients and scratch arrays come from the arena
+	void Init(int ni, double dx);
 	
-	/* Add singly charged Ar+ ions and electrons */
-	/*********************************************/
-	/* Create the species lists*/
-	species_list.emplace_back("Ar+ Ions",40*AMU,QE,ion_spwt, NUM_IONS, ION_TEMP);
-	species_list.emplace_back("Electrons",ME,-QE,electron_spwt, NUM_ELECTRONS, ELECTRON_TEMP);
+	// Arena bytes Init takes for ni nodes
+	static size_t ArenaBytes(int ni);
 	
-	/*Assign the species list as ions and electrons*/
-	Species &ions = species_list[0];	 		
-	Species &electrons = species_list[1];
+	// Refactor for the node positions x of a stretched mesh
+	void SetMesh(const double *x);
 	
-	/*Initialize electrons and ions */	
-	Init(&ions);
-	Init(&electrons);
+	// Change the boundary type and value of one side; refactors only if the type changes
+	void SetBC(Side side, BCType type, double value);
 	
-	for(auto &p:species_list)
-		cout<< p.name << '\n' << p.mass<< '\n' << p.charge << '\n' << p.spwt << '\n' << p.NUM << endl <<endl;
-	/***************************************************************************/
+	// Change the boundary value only (wall bias, floating wall potential, 
+	// Neumann slope dphi/dx), no refactoring needed
+	void SetBCValue(Side side, double value){bc_value[side] = value;}
+	BCType GetBCType(Side side){return bc_type[side];}
+	double GetBCValue(Side side){return bc_value[side];}
 	
-	/*Compute Number Density*/
-	ScatterSpecies(&ions,ndi);
-	ScatterSpecies(&electrons,nde);
+	// Tridiagonal matrix of the grid, for solves outside the class
+	void Matrix(double *a, double *b, double *c){Coefficients(ni, a, b, c);}
 	
-	/*Compute charge density, solve for potential 
-	and compute the electric field*/
-	ComputeRho(&ions, &electrons);
-	SolvePotential(phi, rho);
-	ComputeEF(phi,ef);
+	// Solve with the selected method
+	bool Solve(double *phi, double *rho);
 	
-	RewindSpecies(&ions,ef);
-	RewindSpecies(&electrons,ef);
+	bool SolveDirect(double *x, double *rho);
+	bool SolveGS(double *phi, double *rho);
+	bool SolveMultigrid(double *phi, double *rho);
+	bool SolvePCR(double *x, double *rho);
 	
-	/* Print Output */
-	file_res = fopen("results.dat","w");	
-	file_ke = fopen("ke.dat","w");
+	// Direct solve of nm systems stored [node][member], node i of member m 
+	// at x[i*nm+m], so the substitutions vectorize across the members
+	bool SolveBatch(double *x, double *rho, int nm);
 	
-	/*MAIN LOOP*/
-	for (int ts=0; ts<NUM_TS+1; ts++)
+	// Newton solve with Boltzmann electrons n0*exp(phi/te) (te in V) added 
+	// to the charge density rho of the particles, starting from phi
+	bool SolveBoltzmann(double *phi, double *rho, double n0, double te);
+	
+private:
+	/*One grid of the multigrid hierarchy, in the stencil form of the direct 
+	solver: a[i]u[i-1] + b[i]u[i] + c[i]u[i+1] = g[i], with g scaled by h^2*/
+	struct Level
 	{
-		/*Compute number density*/
-		ScatterSpecies(&ions, ndi);
-		ScatterSpecies(&electrons, nde);
-		
-		/*Compute velocities*/
-		ScatterSpeciesVel(&ions, veli);
-		ScatterSpeciesVel(&electrons, vele);
-		
-		/*Compute charge density*/
-		ComputeRho(&ions, &electrons);
-		
-		//SolvePotential(phi, rho);
-		SolvePotentialDirect(phi, rho);
-		ComputeEF(phi, ef);
-		
-		/*move particles*/
-		PushSpecies(&ions, ef);
-		PushSpecies(&electrons, ef);
-		
-		/*Write diagnostics*/
-		if(ts%200 == 0)
-		{
-			double max_phi = phi[0];
-			for(int i=0; i<domain.ni; i++)
-				if (phi[i]>max_phi) max_phi=phi[i];
-			
-			/*Compute kinetic energy*/
-			//double ke_ions = ComputeKE(&ions)/(ions.NUN*ions.spwt);
-			//double ke_electrons = ComputeKE(&electrons)/(electrons.NUN*electrons.spwt);
-			printf("TS: %i \t delta_phi: %.3g\n", ts, max_phi-phi[0]);
-			WriteKE(Time, &ions, &electrons);	
-			Write_ts(ts);	
-		}
-		
-		/*if(ts!=0 & ts%NUM_TS==0)
-			Write_ts(ts);*/
-		
-		Time += DT;
-		
-	}	
+		int n;                // nodes
+		double *a, *b, *c;
+		double *u, *g, *r;
+	};
 	
-	/*free up memory*/
-	delete phi;
-	delete rho;
-	delete ef;
-	delete nde;
-	delete ndi;
-	delete veli;
-	delete vele;
+	int ni;
+	double dx;
+	Method method = DIRECT;
+	int iterations = 0;   // iterations or cycles of the last solve
+	BCType bc_type[2];
+	double bc_value[2];
+	double *a;            // sub-diagonal
+	double *b;            // diagonal, scratch of the factoring
+	double *c;            // modified super-diagonal
+	double *inv_b;        // inverse of the modified diagonal (pivots)
+	vector<double> h;     // cell widths of a stretched mesh, empty when uniform
+	double *w;            // right hand side weight of each node, dx*dx when uniform
+	bool singular;        // both sides Neumann
+	vector<Level> levels; // multigrid hierarchy, fine to coarse
+	double *pcr[8];       // cyclic reduction coefficients, double buffered
+	double *newton[4];    // Newton matrix and step
 	
-	return 0;
-}
+	// Halve the cells of a multigrid level down to an odd count or 2 cells, 
+	// false at the coarsest level, which is solved directly
+	static bool Coarsen(int &n) {if((n-1)%2 || n-1<=2) return false; n = (n-1)/2+1; return true;}
+	
+	void Factor();
+	void Coefficients(int n, double *a, double *b, double *c);
+	void RightHandSide(double *x, double *rho);
+	bool Undetermined();
+	void Smooth(Level &lev, double *u, int sweeps);
+	void Residual(Level &lev, double *u);
+	void Cycle(int l, double *u);
+};
 
-/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
-/********************* HELPER FUNCTIONS ***************************/
+/* Class BoltzmannElectrons: electrons as a fluid in Boltzmann equilibrium, 
+n0*exp(phi/Te), instead of particles (boltzmann_electrons=true), so the time 
+step only has to resolve the ion motion. The walls absorb the electrons at 
+the thermal flux of their density there, and n0 makes that flux carry the 
+ion flux into the walls, averaged over boltzmann_relax steps: the plasma 
+potential settles where a floating sheath carries no net current*/
+class BoltzmannElectrons
+{
+public:
+	double te = 0;        // electron temperature in V
+	double ion_flux = 0;  // ions into both walls (m^-2 s^-1), relaxed
+	double n0 = 0;        // electron density at phi=0 of the last solve
+	
+	// Start from the Bohm flux of the plasma density into both walls
+	void Init(vector<Species> &species_list);
+	
+	// Relax the ion wall flux to the one of the ion moments, set n0 and 
+	// solve for phi; leaves the electron density in nde and the total 
+	// charge density in rho
+	bool Solve(FieldSolver &solver, double *phi, double *rho);
+};
 
-/*Initialize the particle data : initial positions and velocities of each particle*/
-void Init(Species *species)
+/* Class Decomposition: 1D domain decomposition over MPI ranks, in builds with 
+-DPICS_MPI. Rank r owns the cells [c0,c1) and keeps GHOSTS more nodes past its 
+internal sides for the particle shapes: deposits on them are added to the 
+neighbour owning them, and the potential is copied back. Particles leaving the 
+owned cells in the push move to the neighbour. The potential is solved by 
+superposition: each rank solves its segment with grounded ends, and the 
+potentials of the segment ends follow from a tridiagonal system with one row 
+per rank, which every rank solves. On one rank (and without MPI) the rank owns 
+the whole domain and the communication calls return at once*/
+class Decomposition
 {
-	// sample particle positions and velocities
-	for(int p=0; p<NUM_IONS; p++)
-	{		
-		double x = domain.x0 + rnd()*(domain.ni-1)*domain.dx;
-		double v = SampleVel(species->Temp*EV_TO_K, species->mass);
+public:
+	static const int GHOSTS = 3;
+	int rank = 0, size = 1;
+	int left = -1, right = -1;  // neighbour ranks, -1 at the walls
+	int nc;                     // cells of the whole domain
+	int c0, c1;                 // owned cells [c0,c1), the last rank also owns the right wall node
+	int lo, hi;                 // global indices of the first and last local node
+	double own_x0, own_x1;      // owned positions [own_x0,own_x1)
+	
+	// Start MPI; the standard output of the ranks past the first is discarded
+	void Init(int *argc, char ***argv);
+	void Finalize();
+	
+	// Split nc cells of width dx evenly over the ranks
+	void Split(int nc, double dx);
+	
+	// Factor the solver of the owned segment, with its scratch from the arena
+	void InitSegment();
+	size_t ArenaBytes();
+	
+	// Share of num items spread uniformly over [xmin,xmin+width) that falls 
+	// in the owned cells; clips the range to them
+	int Share(int num, double &xmin, double &width);
+	
+	// File of this rank: the name, suffixed with the rank when decomposed
+	string RankFile(const string &name);
+	
+	// In place reductions over all ranks
+	void Sum(double *data, int n);
+	void Max(double *data, int n);
+	void Broadcast(double *data, int n);
+	
+	// Add the ghost node deposits of nf fields to the neighbours, one message each way
+	void SumGhosts(double **fields, int nf);
+	
+	// Copy the values of the neighbours into the ghost nodes
+	void CopyGhosts(double *field);
+	
+	// Distributed direct solve, with the wall conditions of walls
+	bool SolvePotential(double *phi, double *rho, FieldSolver &walls);
+	
+	// Collect the owned nodes of field into global, the whole domain on rank 0
+	void Gather(const double *field, double *global);
+	
+	// Start sending the particles of species s that left the owned cells in 
+	// the push, so the messages travel during the following pushes, and 
+	// receive all of them into the species at the end of the step
+	void SendMigrants(Species *species, int s);
+	void ReceiveMigrants(vector<Species> &species_list);
+	
+	// Size the migration buffers of each species at setup for the particles 
+	// in the ghost cells of a boundary, so the time steps do not grow them
+	void ReserveMigrants(vector<Species> &species_list);
+	
+private:
+	double dx;
+	FieldSolver segment;       // owned segment with grounded ends
+	vector<double> ends;       // segment data of all ranks for the reduced system
+	double *reduced[4];        // coefficients and solution of the reduced system
+	vector<int> counts, offsets; // owned nodes of each rank in the gathers
+#ifdef PICS_MPI
+	struct Migration
+	{
+		bool pending = false;
+		vector<double> send[2], recv[2]; // pos, vel, id of each particle, left and right
+		int send_count[2], recv_count[2];
+		MPI_Request requests[6];         // count, particles and incoming count, each way
+	};
+	map<int,Migration> migration;      // by species, map nodes stay put while messages are in flight
+	vector<double> ghost_send[2], ghost_recv[2];
+	void Exchange(int n_send[2], int n_recv[2], int tag);
+#endif
+};
+
+/* Class DeviceBackend: runs the main loop on an offload device (OpenMP target 
+regions, in builds with -DPICS_DEVICE) with device=true. The particles and the 
+fields stay resident on the device: the deposit (atomic), the charge density, 
+the field solve (cyclic reduction), the field and the push with the removal of 
+the particles leaving the domain run there, and the state is copied back only 
+when the diagnostics or a checkpoint of the step need it. Without an offload 
+device the same kernels run on the host, so the two paths can be compared 
+in any build*/
+class DeviceBackend
+{
+public:
+	bool active = false;
+	
+	// Allocate the device copies of the fields and the species and upload them
+	void Init(vector<Species> &species_list, FieldSolver &solver);
+	void Free();
+	
+	// Density and flux of species s (host: ScatterSpeciesMoments)
+	void ScatterMoments(int s);
+	// Species moments summed to ndi, nde, veli and vele (host: SumSpeciesMoments)
+	void SumMoments();
+	void ComputeRho();
+	// Cyclic reduction with the wall conditions of solver
+	void SolvePotential(FieldSolver &solver);
+	void ComputeEF();
+	// Push species s at time step ts, subcycled species accumulate the field 
+	// between pushes. Returns the particles pushed
+	int Push(int s, int ts);
+	
+	// Copy the fields back into domain and the species moments, and with 
+	// particles the particles too; nothing if the host is still up to date
+	void Download(bool particles);
+	
+private:
+	struct DeviceSpecies
+	{
+		PartReal *pos, *vel;
+		int *id;
+		unsigned char *flag;
+		int *list;         // holes and movers of the compaction
+		int *counter;      // their counts
+		double *den, *flux, *ef_sum;
+		int np;
+	};
+	vector<Species> *species_list = NULL;
+	vector<DeviceSpecies> species;
+	double *fields[7];     // phi, ef, rho, ndi, nde, veli, vele
+	double *matrix[3];     // a, b, c of the tridiagonal system
+	double *pcr[8];        // cyclic reduction coefficients, double buffered
+	int synced = 0;        // host copy: 0 stale, 1 fields, 2 fields and particles
+	
+	void Compact(DeviceSpecies &ds);
+};
+
+/* Class Ensemble: independent realizations of the run advanced as one batch 
+(ensemble=N), differing in the seed or in ensemble_param. Each member has its 
+own species and random streams, the grid, the field solver and the cross 
+sections are shared. The grid fields of all members are stored [node][member], 
+node i of member m at i*nm+m, so the field solve and the field vectorize 
+across the members; the particle kernels get the column of their member. 
+Member m follows the single run with its seed and parameters bit for bit*/
+class Ensemble
+{
+public:
+	enum Field {NDI, NDE, RHO, VELI, VELE, PHI, EF, NUM_FIELDS}; // results.dat order
+	int nm = 0;                            // members
+	vector<vector<Species>> species;       // species of each member
+	double *fields[NUM_FIELDS];            // [node][member], in the arena
+	
+	// Create and load the members, with the initial field of a single run
+	void Init(const vector<SpeciesInput> &species_input, int members);
+	static size_t ArenaBytes(int ni, int members);
+	
+	// Moments of the species moving at ts, summed to the densities, 
+	// velocities and charge density of each member
+	void ComputeMoments(int ts);
+	
+	// Push, collide and refill the species of every member
+	void Push(int ts);
+	
+	// Stage the ensemble mean and variance of the fields, and the mean 
+	// kinetic energies; returns the mean delta_phi and its spread
+	void Write(int ts, double time, double *delta_phi, double *delta_phi_std);
+	
+private:
+	vector<vector<RandomStream>> streams;  // random streams of each member
+	double *column;                        // field of one member
+	
+	void Column(Field f, int m, double *dst);
+	void SetColumn(Field f, int m, const double *src);
+};
+
+/* Diagnostic job: a staged copy of the data of one output record*/
+struct DiagJob
+{
+	enum Type {FIELDS, KE, AVERAGES, ENSEMBLE, PHASE_SPACE, FLUSH};
+	Type type;
+	double time;
+	int n;                // nodes or particles in the record
+	double *data = NULL;  // staging buffer in the arena, reused from job to job
+	size_t capacity = 0;  // doubles of the staging buffer
+	
+	// Make room for a record of count values
+	void Stage(size_t count)
+	{
+		if(count<=capacity) return;
+		printf("Diagnostics: a record of %zu values overflows the staging buffer of %zu\n", count, capacity);
+		exit(-1);
+	}
+};
+
+/* Class FieldAverage: Running mean and variance (Welford) of the grid fields 
+over an averaging window, updated in place every sample so only the averaged 
+profiles need to be written*/
+class FieldAverage
+{
+public:
+	int nf, ni;             // fields and nodes per field
+	long count;             // samples in the current window
+	int ts_first;           // first time step of the window
+	double *mean = NULL;    // running means, field after field
+	double *m2 = NULL;      // running sums of squared deviations
+	double *std_dev = NULL; // standard deviation of one field, while written
+	
+	// Take the cleared sums of nf fields of ni nodes from the arena
+	void Init(int nf, int ni)
+	{
+		this->nf = nf;
+		this->ni = ni;
+		mean = arena.Take<double>(nf*ni);
+		m2 = arena.Take<double>(nf*ni);
+		std_dev = arena.Take<double>(ni);
+		count = 0;
+	}
+	
+	static size_t ArenaBytes(int nf, int ni) {return 2*Arena::Bytes<double>(nf*ni) + Arena::Bytes<double>(ni);}
+	
+	void Reset()
+	{
+		memset(mean, 0, sizeof(double)*nf*ni);
+		memset(m2, 0, sizeof(double)*nf*ni);
+		count = 0;
+	}
+	
+	// Add one sample of the nf fields
+	void Add(double **fields, int ts)
+	{
+		if(count==0) ts_first = ts;
+		count++;
+		double w = 1.0/count;
+		for(int f=0; f<nf; f++)
+		{
+			double *mu = &mean[f*ni];
+			double *s2 = &m2[f*ni];
+			const double *x = fields[f];
+			#pragma omp simd
+			for(int i=0; i<ni; i++)
+			{
+				double d = x[i]-mu[i];
+				mu[i] += d*w;
+				s2[i] += d*(x[i]-mu[i]);
+			}
+		}
+	}
+};
+
+/* Class PhaseSpace: In-situ (x,v) histograms of each species, and velocity 
+distributions over a few x regions, binned right after the push of each block 
+of particles while it is still in cache. The counts are accumulated over the 
+sampled steps between dumps, so a dump writes a few compact arrays instead of 
+every particle*/
+class PhaseSpace
+{
+public:
+	int nx, nv;                  // position and velocity bins
+	int nreg;                    // regions with a velocity distribution
+	double x0, dx_bin;           // position bins over the domain
+	vector<double> regions;      // xmin, xmax of each region (m)
+	vector<double> vmin, dv;     // velocity bins of each species
+	vector<double*> hist;        // per species: nx*nv histogram (x major), then nreg*nv distributions
+	vector<int> samples;         // samples of each species since the last dump
+	vector<double> binned, outside; // particles binned and outside the velocity range, whole run
+	
+	// Set up the bins, the histograms come from the arena
+	void Init(vector<Species> &species_list, const vector<double> &region_fractions);
+	static size_t ArenaBytes(int ns, int nreg);
+	void Reset();
+	
+	// Bin the particles of species s that stayed in the domain (flag 0, or all 
+	// without flags) into the private histogram of the calling thread
+	void Bin(int s, const PartReal *pos, const PartReal *vel, const unsigned char *flag, int np);
+	
+	// Add the thread histograms to the histogram of species s, one sample
+	void Reduce(int s);
+	
+private:
+	int size;                           // values per species histogram
+	vector<double*> thread_hist;        // private histograms of the threads, then 
+	                                    // their binned and outside counts
+};
+
+/* Class CrossSection: A cross section tabulated on a uniform grid in 
+log(energy), so a lookup is one log and a linear interpolation*/
+class CrossSection
+{
+public:
+	static const int NE = 2000;       // table points from EMIN to EMAX
+	static constexpr double EMIN = 1e-3, EMAX = 1e5; // eV
+	
+	// Tabulate from data points (eV, m^2), interpolated linearly in 
+	// log(energy) and held constant outside the data
+	void Tabulate(const vector<double> &energy, const vector<double> &sigma);
+	
+	double Lookup(double energy) const
+	{
+		double l = (log(energy)-log_emin)*inv_dlog;
+		if(!(l>0)) return table[0];
+		if(l>=NE-1) return table[NE-1];
+		int i = (int)l;
+		return table[i] + (l-i)*(table[i+1]-table[i]);
+	}
+	
+	double Energy(int i) const {return exp(log_emin + i/inv_dlog);}
+	
+	// First table point at or above energy, clipped to the table
+	int Above(double energy) const
+	{
+		double l = (log(energy)-log_emin)*inv_dlog;
+		if(!(l>0)) return 0;
+		return l>=NE-1?NE-1:(int)ceil(l);
+	}
+	
+private:
+	double log_emin, inv_dlog;
+	vector<double> table;
+};
+
+/* Class MonteCarloCollisions: Collisions of the particles with a uniform 
+neutral background, by the null-collision method. Each push step a fraction 
+p_null = 1-exp(-nu_max*dt) of the particles, picked by geometric skips, are 
+candidates; each candidate collides by the process its energy selects, or not 
+at all, so the cost is proportional to the candidates. nu_max only covers the 
+energies up to the fastest particle of the species, and is raised when the 
+species speeds up, so the candidates are not wasted on the tail of the 
+tables no particle reaches. Electrons scatter 
+elastically, ions of the neutral mass scatter elastically or exchange charge. 
+The particles only have vx, so scattering is one dimensional: backward or 
+forward with equal probability in the centre of mass frame*/
+class MonteCarloCollisions
+{
+public:
+	enum Kind {NONE, ELECTRON, ION};
+	
+	// Tabulate the cross sections and nu_max of each species
+	void Init(vector<Species> &species_list);
+	
+	// Collide the particles of species s after their push
+	void Collide(Species *species, int s);
+	
+	// Print the collision counts of the run, and the fraction of the 
+	// candidates that collided
+	void Report(vector<Species> &species_list);
+	
+private:
+	struct Target
+	{
+		Kind kind;
+		double mass;         // particle mass
+		vector<double> nu;   // largest collision frequency up to each table energy
+		double g_max;        // relative speed covered by nu_max
+		double nu_max;       // null collision frequency
+		double p_null;       // candidate probability per push
+		long candidates;     // candidates so far
+		long elastic, cx;    // collisions so far
+	};
+	vector<Target> targets;
+	CrossSection e_elastic, i_elastic, i_cx;
+	double neutral_mass, vth_neutral;
+	
+	// Raise nu_max of t to cover the relative speed g_max
+	void SetNuMax(Target &t, double g_max, Species *species);
+};
+
+/* Class DiagWriter: Asynchronous writer for the diagnostics. The main loop 
+copies its data into a free staging buffer and continues, while a background 
+thread serializes the filled buffers to disk in submission order. With 
+STAGING_BUFFERS buffers one dump is written while the next is being filled*/
+class DiagWriter
+{
+public:
+	static const int STAGING_BUFFERS = 4;
+	
+	void AllocStaging(size_t doubles); // take the staging buffers from the arena
+	void Start(bool async);
+	DiagJob *Acquire();          // free staging buffer, waits if all are in flight
+	void Submit(DiagJob *job);   // queue for writing (written at once when not async)
+	void Finish();               // write the pending jobs and stop the thread
+	
+private:
+	DiagJob jobs[STAGING_BUFFERS];
+	DiagJob *free_jobs[STAGING_BUFFERS];
+	DiagJob *pending[STAGING_BUFFERS];  // ring of jobs waiting for the writer
+	int num_free, num_pending, head;
+	bool async, stop;
+	std::thread worker;
+	std::mutex lock;
+	std::condition_variable cond;
+	
+	void Run();
+};
+
+/* Class PhaseTimer: Wall time of the phases of the main loop. Lap() charges 
+the time since the previous lap to a phase, so each phase costs one clock read. 
+Times are kept for the current reporting interval and for the whole run*/
+class PhaseTimer
+{
+public:
+	enum Phase {SCATTER, RHO, SOLVE, EF, PUSH, SORT, COLLIDE, IO, NUM_PHASES};
+	
+	double interval[NUM_PHASES];  // seconds in the current interval
+	double total[NUM_PHASES];     // seconds in the whole run
+	double pushes_interval;       // particle pushes in the current interval
+	double pushes_total;
+	long bytes_mark;              // bytes written at the start of the interval
+	
+	void Start()
+	{
+		for(int ph=0; ph<NUM_PHASES; ph++) interval[ph] = total[ph] = 0;
+		pushes_interval = pushes_total = 0;
+		bytes_mark = 0;
+		last = std::chrono::steady_clock::now();
+	}
+	
+	void Lap(Phase ph)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double dt = std::chrono::duration<double>(now-last).count();
+		interval[ph] += dt;
+		total[ph] += dt;
+		last = now;
+	}
+	
+	void CountPushes(double n)
+	{
+		pushes_interval += n;
+		pushes_total += n;
+	}
+	
+	// Append one JSON line with the interval (or whole run) breakdown
+	void Report(FILE *file, int ts, bool whole_run, long bytes_written);
+	
+private:
+	std::chrono::steady_clock::time_point last;
+};
+
+/* Class SteadyState: Online steady state detector. Keeps a window of samples 
+of the monitored quantities (delta_phi, particle counts, kinetic energies) and 
+compares the means of the older and the newer half of the window. A quantity 
+is settled when the difference is below tol relative to its mean, or when it 
+is not significant against the windowed variance (noisy quantities)*/
+class SteadyState
+{
+public:
+	int window;     // samples in the window
+	double drift;   // largest relative drift of a changing quantity
+	bool quiet;     // every quantity settled over the last window
+	bool changing;  // some quantity drifts by more than 4*tol, significantly
+	bool steady;    // the detector has fired (stays set)
+	
+	void Init(int nq, int window)
+	{
+		this->nq = nq;
+		this->window = window;
+		samples.assign(window*nq, 0);
+		count = 0;
+		drift = 1;
+		quiet = changing = steady = false;
+	}
+	
+	// Add one sample of the nq quantities; returns true on the sample 
+	// the detector fires
+	bool Add(const double *q, double tol)
+	{
+		memcpy(&samples[(count%window)*nq], q, nq*sizeof(double));
+		count++;
+		if(count<window) return false;
+		
+		int half = window/2;
+		drift = 0;
+		quiet = true;
+		changing = false;
+		for(int k=0; k<nq; k++)
+		{
+			double m_old = 0, m_new = 0, s_old = 0, s_new = 0;
+			for(int s=0; s<half; s++)
+			{
+				double q_old = samples[((count+s)%window)*nq+k];
+				double q_new = samples[((count+window-half+s)%window)*nq+k];
+				m_old += q_old; s_old += q_old*q_old;
+				m_new += q_new; s_new += q_new*q_new;
+			}
+			m_old /= half; m_new /= half;
+			double var = max(s_old/half-m_old*m_old, 0.0) + max(s_new/half-m_new*m_new, 0.0);
+			double diff = fabs(m_new-m_old);
+			double scale = max(fabs(m_old), fabs(m_new));
+			double rel = scale>0?diff/scale:0;
+			bool significant = diff*diff > 4*var/half;    // beyond 2 standard errors
+			if(significant) drift = max(drift, rel);
+			if(significant && rel>=tol) quiet = false;
+			if(significant && rel>4*tol) changing = true;
+		}
+		if(quiet && !steady)
+		{
+			steady = true;
+			return true;
+		}
+		return false;
+	}
+	
+private:
+	int nq;                  // quantities per sample
+	long count;              // samples added
+	vector<double> samples;  // ring of the last window samples
+};
+
+/* Class LiveMonitor: in-situ monitoring through a POSIX shared memory ring 
+buffer (monitor_shm=/name, visible as /dev/shm/name). Every monitor_interval 
+steps the run publishes delta_phi, the particle count and kinetic energy of 
+each species, the phase timings of the run so far and monitor_nodes samples 
+of phi, ndi and nde into the next of monitor_slots slots. A viewer 
+(monitor_view=true, or any program mapping the segment) stamps a heartbeat 
+into the header; without a heartbeat of the last HEARTBEAT_MS the run only 
+reads the stamp and publishes nothing. Layout, all little endian:
+	header: char magic[8] "PICSMON", int32 version, slots, slot_doubles, nodes, 
+		ns, nphases, running, data_offset, uint64 seq (records published, the 
+		newest in slot (seq-1)%slots), int64 heartbeat (ms of CLOCK_MONOTONIC), 
+		double dt, char names[ns][32], double x[nodes]
+	slots from data_offset (whole pages): uint64 seq (0 while written), double ts, time, 
+		delta_phi, count[ns], ke[ns], seconds[nphases], pushes, 
+		phi[nodes], ndi[nodes], nde[nodes]
+A reader copies a slot and keeps it if its seq did not change meanwhile*/
+class LiveMonitor
+{
+public:
+	static const int HEARTBEAT_MS = 2000;
+	static const int VERSION = 1;
+	
+	// Create the segment (rank 0), false if that fails
+	bool Open(const string &name, vector<Species> &species_list);
+	void Close();
+	
+	// A viewer stamped the heartbeat recently; the same answer on all ranks
+	bool Subscribed();
+	
+	// Publish a record of the current step, called on all ranks
+	void Publish(int ts, double time, vector<Species> &species_list, double *phi);
+	
+	// Attach to the segment of a run and print its records until it ends
+	static int View(const string &name);
+	
+private:
+	struct Header
+	{
+		char magic[8];
+		int32_t version, slots, slot_doubles, nodes, ns, nphases, running, data_offset;
+		uint64_t seq;
+		int64_t heartbeat;
+		double dt;
+	};
+	bool enabled = false;
+	string name;
+	Header *header = NULL;
+	size_t bytes = 0;
+	int ns = 0;
+	vector<int> sample;          // nodes of the whole domain sampled
+	vector<double> values, global;
+	
+	static int64_t NowMs();
+	static size_t SlotOffset(const Header *h, uint64_t seq)
+	{
+		return h->data_offset + ((seq-1)%h->slots)*(sizeof(uint64_t)+sizeof(double)*h->slot_doubles);
+	}
+};
+
+/* Per-thread private copies of the grid arrays used by the scatter routines.
+Each copy is padded to whole cache lines to avoid false sharing. Each grid 
+records the span of nodes its thread deposited to; only that span is reduced 
+and cleared again, so with particles sorted by cell each thread touches only 
+its own block of the grid. The grids and the spans are taken from the arena, 
+the spans of each thread in a cache line of their own*/
+double *thread_grids;
+int *grid_span;    // first and last node touched per private grid
+int grid_stride;   // doubles per private grid
+const int grid_slots = 3;  // private grids per thread
+const int span_stride = Arena::ALIGN/sizeof(int); // ints of spans per thread
+
+// Define Helper functions
+void Init(Species *species);
+void ScatterSpecies(Species *species, double *field); 
+void ScatterSpeciesVel(Species *species, double *field);
+void ScatterSpeciesMoments(Species *species, double *den, double *vel, double *temp=NULL);
+template<int ORDER> void ScatterSpeciesShape(Species *species, double *field);
+template<int ORDER> void ScatterSpeciesVelShape(Species *species, double *field);
+template<int ORDER> void ScatterSpeciesMomentsShape(Species *species, double *den, double *vel, double *temp);
+void ComputeRho(vector<Species> &species_list);
+void SumSpeciesMoments(vector<Species> &species_list);
+void ComputeEF(double *phi, double *ef);
+void ComputeEFBatch(double *phi, double *ef, int nm);
+void PushSpecies(Species *species, double *ef, PhaseSpace *phase_space=NULL, int s=0);
+template<int ORDER> void PushSpeciesScalar(Species *species, double *ef);
+void RewindSpecies(Species *species, double *ef);
+void InjectSpecies(Species *species, int num);
+template<int ORDER> void RewindSpeciesShape(Species *species, double *ef);
+FILE *OpenOutput(const char *name, const char *magic, int ni, int nfields, const char **names, const double *x, bool append=false);
+void Write_ts(int ts);
+bool WriteParticles(const string &name, int ts, double Time, vector<Species> &species_list);
+void WriteKE(double Time, vector<Species> &species_list);
+void WriteAverages(FieldAverage &average);
+FILE *OpenPhaseSpace(const char *name, PhaseSpace &phase_space, vector<Species> &species_list, bool append);
+void WritePhaseSpace(PhaseSpace &phase_space, vector<Species> &species_list, double Time);
+bool ReadAverages(const string &name, int ni, vector<double> &fields);
+bool ValidateAverages(const string &name, const string &ref_name, int ni);
+void FlushOutput();
+void WriteJob(DiagJob *job);
+
+DiagWriter diag_writer;
+std::atomic<long> bytes_written(0); // bytes serialized by the diagnostics writer
+PhaseTimer timer;
+
+double ComputeKE(Species *species); 
+void MonitorValues(vector<Species> &species_list, double *phi, double *q);
+double XtoL(double pos);
+double NodeX(int i);
+void DivideByVolume(double *field);
+template<int ORDER=1> void scatter(double lc, double value, double *field);
+template<int ORDER=1> double gather(double lc, const double *field);
+double SampleVel(double T, double mass);
+void LoadParticles(Species *species, int num, double xmin, double width);
+
+size_t ThreadGridBytes();
+void AllocThreadGrids();
+double *ThreadGrid(int slot);
+void MarkThreadGrid(int slot, double lc_min, double lc_max);
+void ReduceThreadGrids(double *field, int slot);
+
+/* Particle push kernels, selected at startup from the detected CPU*/
+typedef void (*PushKernel)(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double dx, double xmax, double dt_qm, double dt);
+PushKernel SelectPushKernel(const char *request, int order, const char **name);
+PushKernel push_kernel = NULL;
+
+bool SolvePotential(double *phi, double *rho);
+bool SolvePotentialDirect(double *phi, double *rho);
+
+FieldSolver field_solver;
+BoltzmannElectrons boltzmann;
+MonteCarloCollisions mcc;
+Decomposition decomp;
+DeviceBackend device;
+LiveMonitor live_monitor;
+double DeltaPhi(double *phi);
+
+void ReadInput(int argc, char *argv[], vector<SpeciesInput> &species_input);
+bool WriteCheckpoint(const string &name, int ts_next, double Time, vector<Species> &species_list);
+bool ReadCheckpoint(const string &name, int &ts_next, double &Time, vector<Species> &species_list);
+void HandleSigterm(int);
+volatile sig_atomic_t sigterm_received = 0;
+void InitDomain(int nc, double dx, int ns=0);
+size_t ArenaBytes(int ns);
+size_t StagingDoubles(int ns);
+void InitMesh(double stretch);
+void FreeDomain();
+void CreateSpecies(const vector<SpeciesInput> &species_input, vector<Species> &species_list);
+int RunEnsemble(vector<SpeciesInput> &species_input);
+int RunBenchmarks();
+bool SetParam(const string &key, const string &value);
+bool ParseRegions(const string &text, vector<double> &regions);
+
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/********************* MAIN FUNCTION ***************************/
+int main(int argc, char *argv[])
+{	
+	/*Start MPI when built with it*/
+	decomp.Init(&argc, &argv);
+	
+	/*Read the input deck and the command line overrides*/
+	vector<SpeciesInput> species_input;
+	ReadInput(argc, argv, species_input);
+	
+	/*Benchmark mode runs the kernel sweeps instead of a simulation*/
+	if(BENCHMARK)
+	{
+		int status = 1;
+		if(decomp.size>1) printf("Run the benchmarks on a single rank\n");
+		else status = RunBenchmarks();
+		decomp.Finalize();
+		return status;
+	}
+	
+	/*Viewer mode prints the records of a running simulation*/
+	if(MONITOR_VIEW)
+	{
+		int status = LiveMonitor::View(MONITOR_SHM);
+		decomp.Finalize();
+		return status;
+	}
+	
+	/*Ensemble mode advances the members as one batch*/
+	if(ENSEMBLE>0)
+	{
+		int status = 1;
+		if(decomp.size>1) printf("Run ensembles on a single rank\n");
+		else status = RunEnsemble(species_input);
+		decomp.Finalize();
+		return status;
+	}
+	
+	double Time = 0;
+	/*Construct the domain and the arena holding the field variables*/	
+	InitDomain(NC, DX, species_input.empty()?2:species_input.size());
+	InitMesh(MESH_STRETCH);
+	
+	/*Redifine the field variables */
+	double *phi = domain.phi;
+	double *ef = domain.ef;
+	double *rho = domain.rho;
+	
+	/**************************************************/
+		
+	/*Species Info: Create vector to hold the data*/
+	vector <Species> species_list;
+	CreateSpecies(species_input, species_list);
+	if(BOLTZMANN_ELECTRONS) boltzmann.Init(species_list);
+	
+	/*Factor the field solver with grounded walls*/
+	field_solver.Init(domain.ni, domain.dx);
+	if(!domain.uniform) field_solver.SetMesh(domain.xn.data());
+	FieldSolver::Method solver_method;
+	FieldSolver::MethodFromName(FIELD_SOLVER, &solver_method);
+	field_solver.SetMethod(solver_method);
+	if(DEVICE && decomp.size>1)
+	{
+		printf("device=true runs on a single rank\n");
+		exit(-1);
+	}
+	if(BOLTZMANN_ELECTRONS && decomp.size>1)
+	{
+		printf("boltzmann_electrons runs on a single rank\n");
+		exit(-1);
+	}
+	if(!domain.uniform && decomp.size>1)
+	{
+		printf("mesh_stretch runs on a single rank\n");
+		exit(-1);
+	}
+	if(!domain.uniform)
+		printf("Mesh: %i cells stretched by %g, %g m at the walls, %g m in the middle\n", NC, MESH_STRETCH, 
+			1/domain.inv_h[0], 1/domain.inv_h[NC/2]);
+	if(decomp.size>1)
+		printf("Field solver: distributed direct over %i ranks, %i cells each\n", decomp.size, NC/decomp.size);
+	else if(BOLTZMANN_ELECTRONS)
+		printf("Field solver: Newton with Boltzmann electrons at %g eV\n", ELECTRON_TEMP);
+	else if(DEVICE)
+		printf("Field solver: pcr on the device\n");
+	else
+		printf("Field solver: %s\n", FIELD_SOLVER.c_str());
+	
+	/*Tabulate the collision cross sections*/
+	if(MCC) mcc.Init(species_list);
+	
+	/*Set up the per-thread random streams and private grids*/
+	InitRandomStreams(omp_get_max_threads(), SEED, decomp.rank*omp_get_max_threads());
+	AllocThreadGrids();
+	printf("Threads: %i\n", omp_get_max_threads());
+	
+	/*Select the particle push kernel*/
+	const char *kernel_name;
+	push_kernel = SelectPushKernel(PUSH_KERNEL.c_str(), SHAPE_ORDER, &kernel_name);
+	printf("Push kernel: %s, shape order %i\n", DEVICE?"device":kernel_name, SHAPE_ORDER);
+	
+	/*Restart from a checkpoint, or initialize the species */	
+	int ts_start = 0;
+	bool restarted = !RESTART.empty();
+	if(restarted)
+	{
+		if(!ReadCheckpoint(RESTART, ts_start, Time, species_list)) exit(-1);
+		printf("Restarted from %s at TS: %i\n", RESTART.c_str(), ts_start);
+	}
+	else
+	{
+		for(auto &sp:species_list)
+			Init(&sp);
+	}
+	decomp.ReserveMigrants(species_list);
+	
+	for(auto &p:species_list)
+		cout<< p.name << '\n' << p.mass<< '\n' << p.charge << '\n' << p.spwt << '\n' << p.NUM << endl <<endl;
+	/***************************************************************************/
+	
+	if(!restarted)
+	{
+		/*Compute Number Density*/
+		for(auto &sp:species_list)
+			ScatterSpecies(&sp,sp.den.data());
+		SumSpeciesMoments(species_list);
+		
+		/*Compute charge density, solve for potential 
+		and compute the electric field*/
+		ComputeRho(species_list);
+		if(decomp.size>1) decomp.SolvePotential(phi, rho, field_solver);
+		else if(BOLTZMANN_ELECTRONS) boltzmann.Solve(field_solver, phi, rho);
+		else SolvePotential(phi, rho);
+		ComputeEF(phi,ef);
+		
+		for(auto &sp:species_list)
+			RewindSpecies(&sp,ef);
+	}
+	
+	/*Move the particles and fields to the device for the main loop*/
+	if(DEVICE)
+	{
+		device.Init(species_list, field_solver);
+#ifdef PICS_DEVICE
+		if(omp_get_num_devices()>0)
+			printf("Device: %i of %i offload devices\n", omp_get_default_device(), omp_get_num_devices());
+		else
+			printf("Device: no offload device, the device kernels run on the host\n");
+#endif
+	}
+	
+	/*Checkpoint and stop cleanly when the job is preempted*/
+	signal(SIGTERM, HandleSigterm);
+	
+	/* Print Output */
+	const char *res_names[] = {"ndi","nde","rho","veli","vele","phi","ef"};
+	vector<const char*> ke_names;
+	for(auto &sp:species_list)
+		ke_names.push_back(sp.name.c_str());
+	vector<double> x_nodes(domain.ng);
+	for(int i=0; i<domain.ng; i++)
+		x_nodes[i] = NodeX(i);
+	
+	/*rank 0 writes the output of the whole domain*/
+	bool writer = (decomp.rank==0);
+	string res_name = OUTPUT_PREFIX + (BINARY_OUTPUT?"results.bin":"results.dat");
+	string ke_name = OUTPUT_PREFIX + (BINARY_OUTPUT?"ke.bin":"ke.dat");
+	if(writer)
+	{
+		file_res = OpenOutput(res_name.c_str(), "PICSRES", domain.ng, 7, res_names, x_nodes.data(), restarted);	
+		file_ke = OpenOutput(ke_name.c_str(), "PICSKE", 1, ke_names.size(), ke_names.data(), NULL, restarted);
+	}
+	
+	/*Time averaged profiles: mean and standard deviation of each field*/
+	const char *avg_names[] = {"ndi","ndi_std","nde","nde_std","veli","veli_std",
+		"vele","vele_std","phi","phi_std","ef","ef_std"};
+	double *avg_fields[] = {domain.ndi, domain.nde, domain.veli, domain.vele, phi, ef};
+	FieldAverage average;
+	bool averaging = AVERAGE;
+	if(AVERAGE || STEADY_ACTION=="average")
+	{
+		string avg_name = OUTPUT_PREFIX + (BINARY_OUTPUT?"averages.bin":"averages.dat");
+		if(writer) file_avg = OpenOutput(avg_name.c_str(), "PICSAVG", domain.ng, 12, avg_names, x_nodes.data(), restarted);
+		average.Init(6, domain.ni);
+	}
+	
+	/*Phase space histograms, sampled every ps_stride steps and written with each dump*/
+	PhaseSpace phase_space;
+	if(PHASE_SPACE)
+	{
+		vector<double> region_fractions;
+		ParseRegions(VDF_REGIONS, region_fractions);
+		phase_space.Init(species_list, region_fractions);
+		string ps_name = OUTPUT_PREFIX + "phase_space.bin";
+		if(writer) file_ps = OpenPhaseSpace(ps_name.c_str(), phase_space, species_list, restarted);
+	}
+	printf("Arena: %.3g MB, %.3g MB taken\n", arena.Capacity()/1e6, arena.Used()/1e6);
+	diag_writer.Start(ASYNC_OUTPUT);
+	
+	FILE *file_timing = NULL;
+	if(TIMING && writer)
+	{
+		string timing_name = OUTPUT_PREFIX + "timing.jsonl";
+		file_timing = fopen(timing_name.c_str(),restarted?"a":"w");
+	}
+	timer.Start();
+	if(!MONITOR_SHM.empty()) live_monitor.Open(MONITOR_SHM, species_list);
+	
+	/*Steady state detector on delta_phi, the particle counts and the kinetic 
+	energies; the same quantities pace the dumps with adaptive_diag*/
+	int nq = 1+2*species_list.size();
+	vector<double> monitor(nq);
+	SteadyState steady_state;
+	steady_state.Init(nq, STEADY_WINDOW);
+	int diag_interval = DIAG_INTERVAL;
+	int num_dumps = (ts_start+DIAG_INTERVAL-1)/DIAG_INTERVAL;
+	int next_dump = num_dumps*DIAG_INTERVAL;
+	
+	/*Sort interval of each species, tuned with sort_auto*/
+	vector<int> sort_interval(species_list.size(), SORT_INTERVAL);
+	vector<int> next_sort(species_list.size(), ts_start);
+	
+	/*Heap allocations of the time steps after the first, less those of the 
+	checkpoints and particle dumps, which build their files*/
+	long alloc_start = heap_allocations, alloc_io = 0;
+	
+	/*MAIN LOOP*/
+	for (int ts=ts_start; ts<NUM_TS+1; ts++)
+	{
+		if(ts==ts_start+1) {alloc_start = heap_allocations; alloc_io = 0;}
+		
+		/*Sort the particles by cell, so the deposits and gathers walk the 
+		grid in order. The tuned interval doubles while the particles stay 
+		ordered and halves, down to sort_interval, when they disorder faster 
+		than sort_disorder*/
+		for(size_t s=0; SORT_INTERVAL>0 && s<species_list.size(); s++)
+		{
+			if(ts<next_sort[s]) continue;
+			double disorder = species_list[s].part_list.sort_by_cell(domain.x0, domain.dx, 
+				domain.ni-1, SORT_AUTO?0.5*SORT_DISORDER:0);
+			if(SORT_AUTO)
+			{
+				if(disorder<0.5*SORT_DISORDER) sort_interval[s] = min(2*sort_interval[s], SORT_INTERVAL_MAX);
+				else if(disorder>SORT_DISORDER) sort_interval[s] = max(sort_interval[s]/2, SORT_INTERVAL);
+			}
+			next_sort[s] = ts + sort_interval[s];
+		}
+		timer.Lap(PhaseTimer::SORT);
+		
+		/*Compute number densities and velocities (subcycled species only 
+		after they moved)*/
+		for(size_t s=0; s<species_list.size(); s++)
+		{
+			Species &sp = species_list[s];
+			if(ts%sp.subcycle!=0) continue;
+			if(device.active) device.ScatterMoments(s);
+			else ScatterSpeciesMoments(&sp, sp.den.data(), sp.vel.data());
+		}
+		if(device.active) device.SumMoments();
+		else SumSpeciesMoments(species_list);
+		timer.Lap(PhaseTimer::SCATTER);
+		
+		/*Compute charge density*/
+		if(device.active) device.ComputeRho();
+		else ComputeRho(species_list);
+		timer.Lap(PhaseTimer::RHO);
+		
+		//SolvePotential(phi, rho);
+		if(device.active) device.SolvePotential(field_solver);
+		else if(decomp.size>1) decomp.SolvePotential(phi, rho, field_solver);
+		else if(!BOLTZMANN_ELECTRONS) field_solver.Solve(phi, rho);
+		else if(!boltzmann.Solve(field_solver, phi, rho))
+			printf("TS: %i Newton iterations did not converge\n", ts);
+		timer.Lap(PhaseTimer::SOLVE);
+		if(device.active) device.ComputeEF();
+		else ComputeEF(phi, ef);
+		timer.Lap(PhaseTimer::EF);
+		
+		/*move particles*/
+		for(size_t s=0; s<species_list.size(); s++)
+		{
+			Species &sp = species_list[s];
+			if(device.active)
+			{
+				timer.CountPushes(device.Push(s, ts));
+				continue;
+			}
+			
+			/*subcycled species: accumulate the field, push at the end of 
+			the cycle in the averaged field*/
+			double *sp_ef = ef;
+			if(sp.subcycle>1)
+			{
+				double *ef_sum = sp.ef_sum.data();
+				for(int i=0; i<domain.ni; i++) ef_sum[i] += ef[i];
+				if(ts%sp.subcycle!=sp.subcycle-1) continue;
+				for(int i=0; i<domain.ni; i++) ef_sum[i] /= sp.subcycle;
+				sp_ef = ef_sum;
+			}
+			
+			/*bin the phase space in the push covering a sample step*/
+			bool sample = PHASE_SPACE && (ts+PS_STRIDE)/PS_STRIDE > (ts+PS_STRIDE-sp.subcycle)/PS_STRIDE;
+			
+			int np = sp.part_list.size();
+			timer.CountPushes(np);
+			PushSpecies(&sp, sp_ef, sample?&phase_space:NULL, s);
+			if(sp.subcycle>1) sp.ef_sum.assign(domain.ni,0);
+			
+			/*collide with the neutrals*/
+			if(MCC)
+			{
+				timer.Lap(PhaseTimer::PUSH);
+				mcc.Collide(&sp, s);
+				timer.Lap(PhaseTimer::COLLIDE);
+			}
+			
+			/*replace the particles lost to the walls in the source region*/
+			if(SOURCE) InjectSpecies(&sp, np-sp.part_list.size());
+			
+			/*hand the particles that left the owned cells to the neighbours*/
+			decomp.SendMigrants(&sp, s);
+		}
+		decomp.ReceiveMigrants(species_list);
+		timer.Lap(PhaseTimer::PUSH);
+		
+		/*Sample the steady state detector*/
+		bool stop_steady = false;
+		if(STEADY_CHECK>0 && ts%STEADY_CHECK==0)
+		{
+			if(device.active) device.Download(true);
+			MonitorValues(species_list, phi, monitor.data());
+			if(steady_state.Add(monitor.data(), STEADY_TOL))
+			{
+				printf("Steady state at TS: %i, drift %.3g over %i samples\n", ts, 
+					steady_state.drift, STEADY_WINDOW);
+				stop_steady = (STEADY_ACTION=="stop");
+				if(STEADY_ACTION=="average" && !averaging)
+				{
+					averaging = true;
+					AVERAGE_START = ts;
+				}
+			}
+		}
+		
+		/*Accumulate the time averages, and write them at the end of each window*/
+		if(averaging && ts>=AVERAGE_START && (ts-AVERAGE_START)%AVERAGE_STRIDE==0)
+		{
+			if(device.active) device.Download(false);
+			average.Add(avg_fields, ts);
+			if(AVERAGE_WINDOW>0 && ts+AVERAGE_STRIDE-average.ts_first>=AVERAGE_WINDOW)
+			{
+				WriteAverages(average);
+				average.Reset();
+			}
+		}
+		
+		/*Write diagnostics, always with the last state when stopping early*/
+		if(ts==next_dump || stop_steady)
+		{
+			if(device.active) device.Download(true);
+			double delta_phi = DeltaPhi(phi);
+			
+			/*Compute kinetic energy*/
+			//double ke_ions = ComputeKE(&ions)/(ions.NUN*ions.spwt);
+			//double ke_electrons = ComputeKE(&electrons)/(electrons.NUN*electrons.spwt);
+			printf("TS: %i \t delta_phi: %.3g\n", ts, delta_phi);
+			WriteKE(Time, species_list);	
+			if(SNAPSHOTS) Write_ts(ts);	
+			if(PHASE_SPACE)
+			{
+				WritePhaseSpace(phase_space, species_list, Time);
+				phase_space.Reset();
+			}
+			
+			num_dumps++;
+			if(FLUSH_INTERVAL>0 && num_dumps%FLUSH_INTERVAL==0)
+				FlushOutput();
+			timer.Lap(PhaseTimer::IO);
+			
+			if(file_timing) timer.Report(file_timing, ts, false, bytes_written);
+			
+			/*double the dump interval while the detector window is quiet, 
+			halve it while something changes fast*/
+			if(ADAPTIVE_DIAG)
+			{
+				if(steady_state.quiet) diag_interval = min(2*diag_interval, DIAG_INTERVAL_MAX);
+				else if(steady_state.changing) diag_interval = max(diag_interval/2, DIAG_INTERVAL);
+			}
+			next_dump = ts + diag_interval;
+		}
+		
+		/*Raw particles, for the runs that need them*/
+		if(PARTICLE_INTERVAL>0 && ts%PARTICLE_INTERVAL==0)
+		{
+			if(device.active) device.Download(true);
+			long allocs = heap_allocations;
+			char particle_name[32];
+			snprintf(particle_name, sizeof(particle_name), "particles_%08i.bin", ts);
+			WriteParticles(OUTPUT_PREFIX+particle_name, ts, Time, species_list);
+			alloc_io += heap_allocations-allocs;
+			timer.Lap(PhaseTimer::IO);
+		}
+		
+		/*Live monitor records, only a look at the heartbeat while no viewer is attached*/
+		if(!MONITOR_SHM.empty() && ts%MONITOR_INTERVAL==0 && live_monitor.Subscribed())
+		{
+			if(device.active) device.Download(true);
+			live_monitor.Publish(ts, Time, species_list, phi);
+			timer.Lap(PhaseTimer::IO);
+		}
+		
+		/*if(ts!=0 & ts%NUM_TS==0)
+			Write_ts(ts);*/
+		
+		Time += DT;
+		
+		/*Checkpoint at fixed intervals, and stop after one on SIGTERM (on 
+		any rank, the ranks stop together)*/
+		double sigterm = sigterm_received;
+		decomp.Max(&sigterm, 1);
+		bool stop = sigterm>0;
+		if(stop || (CHECKPOINT_INTERVAL>0 && (ts+1)%CHECKPOINT_INTERVAL==0))
+		{
+			if(device.active) device.Download(true);
+			long allocs = heap_allocations;
+			WriteCheckpoint(OUTPUT_PREFIX+CHECKPOINT_FILE, ts+1, Time, species_list);
+			alloc_io += heap_allocations-allocs;
+			timer.Lap(PhaseTimer::IO);
+		}
+		if(stop)
+		{
+			printf("SIGTERM received, checkpoint written at TS: %i\n", ts+1);
+			break;
+		}
+		if(stop_steady) break;
+	}	
+	
+	/*counted by builds with -DPICS_ALLOC_COUNT only*/
+	if(heap_allocations>0)
+	{
+		double allocs[2] = {(double)(heap_allocations-alloc_start-alloc_io), (double)alloc_io};
+		decomp.Max(allocs, 2);
+		printf("Heap allocations: %.0f in the time steps after the first, %.0f in checkpoints and particle dumps\n", 
+			allocs[0], allocs[1]);
+		if(allocs[0]>0) printf("Warning: the time steps allocated from the heap\n");
+	}
+	
+	/*write the last (partial) averaging window and close the output files*/
+	if(averaging && average.count>0) WriteAverages(average);
+	diag_writer.Finish();
+	if(file_res) fclose(file_res);
+	if(file_ke) fclose(file_ke);
+	if(file_avg) fclose(file_avg);
+	if(file_ps) fclose(file_ps);
+	timer.Lap(PhaseTimer::IO);
+	
+	if(MCC) mcc.Report(species_list);
+	
+	/*the velocity ranges should hold (nearly) all particles*/
+	if(PHASE_SPACE)
+	{
+		decomp.Sum(phase_space.binned.data(), species_list.size());
+		decomp.Sum(phase_space.outside.data(), species_list.size());
+	}
+	for(size_t s=0; file_ps && s<species_list.size(); s++)
+	{
+		double total = phase_space.binned[s]+phase_space.outside[s];
+		if(phase_space.outside[s]>0.01*total)
+			printf("Phase space: %.3g%% of the %s samples were outside +-%g m/s, raise vmax\n", 
+				100*phase_space.outside[s]/total, species_list[s].name.c_str(), -phase_space.vmin[s]);
+	}
+	
+	decomp.Sum(&timer.pushes_total, 1);
+	double run_time = 0;
+	for(int ph=0; ph<PhaseTimer::NUM_PHASES; ph++)
+		run_time += timer.total[ph];
+	printf("Run time: %.3g s, %.3g particle pushes/s, %.3g MB written\n", run_time, 
+		timer.pushes_total/run_time, bytes_written/1e6);
+	if(file_timing)
+	{
+		timer.Report(file_timing, NUM_TS, true, bytes_written);
+		fclose(file_timing);
+	}
+	
+	/*compare the averaged profiles against the reference run*/
+	bool valid = true;
+	if(!VALIDATE.empty() && writer)
+	{
+		string avg_name = OUTPUT_PREFIX + (BINARY_OUTPUT?"averages.bin":"averages.dat");
+		valid = ValidateAverages(avg_name, VALIDATE, domain.ng);
+	}
+	
+	/*free up memory*/
+	if(device.active) device.Free();
+	live_monitor.Close();
+	FreeDomain();
+	decomp.Finalize();
+	
+	return valid?0:1;
+}
+
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/********************* HELPER FUNCTIONS ***************************/
+
+/*Create the species of the deck, with specific weights from the plasma 
+density. Without species in the deck, add singly charged Ar+ ions and electrons. 
+With Boltzmann electrons the electron species are left out, the fluid takes 
+their temperature*/
+void CreateSpecies(const vector<SpeciesInput> &species_input, vector<Species> &species_list)
+{
+	vector<SpeciesInput> inputs = species_input;
+	if(inputs.empty())
+	{
+		inputs.push_back({"Ar+ Ions", 40*AMU, QE, NUM_IONS, ION_TEMP, ION_SUBCYCLE});
+		inputs.push_back({"Electrons", ME, -QE, NUM_ELECTRONS, ELECTRON_TEMP});
+	}
+	
+	for(auto &in:inputs)
+	{
+		if(BOLTZMANN_ELECTRONS && in.charge<0 && fabs(in.mass-ME)<1e-3*ME)
+		{
+			ELECTRON_TEMP = in.temp;  // temperature of the Boltzmann electrons
+			continue;
+		}
+		double spwt = (PLASMA_DEN*domain.xl)/(in.num);
+		if(in.subcycle<1)
+		{
+			printf("%s: subcycle must be at least 1\n", in.name.c_str());
+			exit(-1);
+		}
+		species_list.emplace_back(in.name, in.mass, in.charge, spwt, in.num, in.temp);
+		species_list.back().subcycle = in.subcycle;
+		species_list.back().vmax = in.vmax;
+		species_list.back().den.assign(domain.ni,0);
+		species_list.back().vel.assign(domain.ni,0);
+		species_list.back().ef_sum.assign(domain.ni,0);
+		
+		/*each rank numbers its particles in its own share of the id range, so 
+		the ids stay unique when the particles migrate*/
+		species_list.back().setPartId(decomp.rank*(INT_MAX/decomp.size));
+		if(SORT_INTERVAL>0 || PARTICLE_INTERVAL>0)
+			species_list.back().part_list.cell_start = arena.Take<int>((size_t)omp_get_max_threads()*(domain.ni-1));
+	}
+}
+
+/*Construct the domain parameters for nc cells, size the arena for the grid 
+and ns species and take the cleared field variables and the diagnostics 
+staging buffers from it. The whole domain starts at 0; decomposed over MPI 
+ranks, the fields of a rank cover its owned and ghost nodes*/
+void InitDomain(int nc, double dx, int ns)
+{
+	decomp.Split(nc, dx);
+	domain.ng = nc+1;
+	domain.ni = decomp.hi-decomp.lo+1;
+	domain.dx = dx;
+	domain.x0 = decomp.lo*dx;
+	domain. xl = (domain.ng-1)*domain.dx;
+	domain.xmax = decomp.hi*dx;
+	domain.uniform = true;
+	arena.Init(ArenaBytes(ns));
+	
+	/*Take the domain data structures (Field variables), cleared*/
+	domain.phi = arena.Take<double>(domain.ni);
+	domain.ef = arena.Take<double>(domain.ni);
+	domain.rho = arena.Take<double>(domain.ni);
+	domain.nde = arena.Take<double>(domain.ni);
+	domain.ndi = arena.Take<double>(domain.ni);
+	domain.veli = arena.Take<double>(domain.ni);
+	domain.vele = arena.Take<double>(domain.ni);
+	
+	decomp.InitSegment();
+	diag_writer.AllocStaging(StagingDoubles(ns));
+}
+
+/*Arena bytes of a run on the domain with ns species: the fields, the private 
+grids of the threads, the field solvers and their scratch, the staging 
+buffers, and those of the options in use: the sort scratch of the species, 
+the averages, the phase space histograms and the ensemble fields*/
+size_t ArenaBytes(int ns)
+{
+	size_t bytes = 7*Arena::Bytes<double>(domain.ni);
+	bytes += ThreadGridBytes();
+	bytes += FieldSolver::ArenaBytes(domain.ni);
+	bytes += decomp.ArenaBytes();
+	bytes += DiagWriter::STAGING_BUFFERS*Arena::Bytes<double>(StagingDoubles(ns));
+	if(SORT_INTERVAL>0 || PARTICLE_INTERVAL>0)
+		bytes += ns*ParticleArray::SortScratchBytes(domain.ni-1);
+	if(AVERAGE || STEADY_ACTION=="average")
+		bytes += FieldAverage::ArenaBytes(6, domain.ni);
+	vector<double> regions;
+	if(PHASE_SPACE)
+		bytes += PhaseSpace::ArenaBytes(ns, ParseRegions(VDF_REGIONS, regions)?regions.size()/2:0);
+	if(ENSEMBLE>0)
+		bytes += Ensemble::ArenaBytes(domain.ni, ENSEMBLE);
+	return bytes;
+}
+
+/*Largest diagnostics record of ns species: the fields, the averages or the 
+ensemble statistics (two values of 7 fields per node), the kinetic energies 
+or the phase space histograms*/
+size_t StagingDoubles(int ns)
+{
+	size_t n = max((size_t)14*domain.ng, (size_t)ns);
+	vector<double> regions;
+	if(PHASE_SPACE && ParseRegions(VDF_REGIONS, regions))
+		n = max(n, (size_t)ns*(PS_NX+regions.size()/2)*PS_NV);
+	return n;
+}
+
+/*Stretch the nodes toward the walls, x(s) = xl*(s - alpha*sin(2 pi s)/(2 pi)) 
+for s = i/nc: the cells grow smoothly from the walls to the middle by the 
+ratio stretch = (1+alpha)/(1-alpha), keeping the domain length. The lookup 
+bins are no wider than the wall cells, so each overlaps at most two cells*/
+void InitMesh(double stretch)
+{
+	if(stretch==1) return;
+	int nc = domain.ng-1;
+	double alpha = (stretch-1)/(stretch+1);
+	domain.uniform = false;
+	domain.xn.resize(nc+1);
+	domain.inv_h.resize(nc);
+	domain.volume.resize(nc+1);
+	for(int i=0; i<=nc; i++)
+	{
+		double s = (double)i/nc;
+		domain.xn[i] = domain.xl*(s - alpha*sin(2*pi*s)/(2*pi));
+	}
+	domain.xn[0] = 0;
+	domain.xn[nc] = domain.xl;
+	
+	double h_min = domain.xl;
+	for(int j=0; j<nc; j++)
+	{
+		double h = domain.xn[j+1]-domain.xn[j];
+		domain.inv_h[j] = 1/h;
+		h_min = min(h_min, h);
+	}
+	for(int i=1; i<nc; i++)
+		domain.volume[i] = 0.5*(domain.xn[i+1]-domain.xn[i-1]);
+	domain.volume[0] = 0.5*(domain.xn[1]-domain.xn[0]);
+	domain.volume[nc] = 0.5*(domain.xn[nc]-domain.xn[nc-1]);
+	
+	MeshLookup &map = domain.lookup;
+	map.nbins = (int)ceil(domain.xl/h_min);
+	map.x0 = domain.x0;
+	map.inv_bin = map.nbins/domain.xl;
+	domain.bin_cell.resize(map.nbins);
+	int j = 0;
+	for(int b=0; b<map.nbins; b++)
+	{
+		double x = b/map.inv_bin;
+		while(j<nc-1 && domain.xn[j+1]<=x) j++;
+		domain.bin_cell[b] = j;
+	}
+	map.xn = domain.xn.data();
+	map.inv_h = domain.inv_h.data();
+	map.bin_cell = domain.bin_cell.data();
+}
+
+/*Release the arena, with the fields and all the buffers taken from it*/
+void FreeDomain()
+{
+	arena.Release();
+	domain.phi = domain.ef = domain.rho = NULL;
+	domain.nde = domain.ndi = domain.veli = domain.vele = NULL;
+}
+
+/* Input deck parameters: key, type (d: double, i: int, b: bool, s: string) and variable*/
+struct InputParam
+{
+	const char *key;
+	char type;
+	void *ptr;
+};
+
+InputParam input_params[] = {
+	{"plasma_den", 'd', &PLASMA_DEN},
+	{"dx", 'd', &DX},
+	{"dt", 'd', &DT},
+	{"electron_temp", 'd', &ELECTRON_TEMP},
+	{"ion_temp", 'd', &ION_TEMP},
+	{"ion_subcycle", 'i', &ION_SUBCYCLE},
+	{"num_ions", 'i', &NUM_IONS},
+	{"num_electrons", 'i', &NUM_ELECTRONS},
+	{"nc", 'i', &NC},
+	{"mesh_stretch", 'd', &MESH_STRETCH},
+	{"num_ts", 'i', &NUM_TS},
+	{"seed", 'i', &SEED},
+	{"diag_interval", 'i', &DIAG_INTERVAL},
+	{"binary_output", 'b', &BINARY_OUTPUT},
+	{"flush_interval", 'i', &FLUSH_INTERVAL},
+	{"output_buffer", 'i', &OUTPUT_BUFFER},
+	{"async_output", 'b', &ASYNC_OUTPUT},
+	{"output_prefix", 's', &OUTPUT_PREFIX},
+	{"push_kernel", 's', &PUSH_KERNEL},
+	{"shape_order", 'i', &SHAPE_ORDER},
+	{"timing", 'b', &TIMING},
+	{"field_solver", 's', &FIELD_SOLVER},
+	{"mg_tol", 'd', &MG_TOL},
+	{"mg_max_cycles", 'i', &MG_MAX_CYCLES},
+	{"mg_sweeps", 'i', &MG_SWEEPS},
+	{"boltzmann_electrons", 'b', &BOLTZMANN_ELECTRONS},
+	{"boltzmann_relax", 'i', &BOLTZMANN_RELAX},
+	{"newton_tol", 'd', &NEWTON_TOL},
+	{"newton_max_iter", 'i', &NEWTON_MAX_ITER},
+	{"phase_space", 'b', &PHASE_SPACE},
+	{"ps_nx", 'i', &PS_NX},
+	{"ps_nv", 'i', &PS_NV},
+	{"ps_vmax", 'd', &PS_VMAX},
+	{"ps_stride", 'i', &PS_STRIDE},
+	{"vdf_regions", 's', &VDF_REGIONS},
+	{"mcc", 'b', &MCC},
+	{"neutral_den", 'd', &NEUTRAL_DEN},
+	{"neutral_temp", 'd', &NEUTRAL_TEMP},
+	{"neutral_mass", 'd', &NEUTRAL_MASS},
+	{"xs_e_elastic", 's', &XS_E_ELASTIC},
+	{"xs_i_elastic", 's', &XS_I_ELASTIC},
+	{"xs_i_cx", 's', &XS_I_CX},
+	{"sort_interval", 'i', &SORT_INTERVAL},
+	{"sort_auto", 'b', &SORT_AUTO},
+	{"sort_disorder", 'd', &SORT_DISORDER},
+	{"sort_interval_max", 'i', &SORT_INTERVAL_MAX},
+	{"source", 'b', &SOURCE},
+	{"source_xmin", 'd', &SOURCE_XMIN},
+	{"source_xmax", 'd', &SOURCE_XMAX},
+	{"steady_check", 'i', &STEADY_CHECK},
+	{"steady_window", 'i', &STEADY_WINDOW},
+	{"steady_tol", 'd', &STEADY_TOL},
+	{"steady_action", 's', &STEADY_ACTION},
+	{"adaptive_diag", 'b', &ADAPTIVE_DIAG},
+	{"diag_interval_max", 'i', &DIAG_INTERVAL_MAX},
+	{"average", 'b', &AVERAGE},
+	{"average_start", 'i', &AVERAGE_START},
+	{"average_window", 'i', &AVERAGE_WINDOW},
+	{"average_stride", 'i', &AVERAGE_STRIDE},
+	{"snapshots", 'b', &SNAPSHOTS},
+	{"particle_interval", 'i', &PARTICLE_INTERVAL},
+	{"particle_chunk", 'i', &PARTICLE_CHUNK},
+	{"validate", 's', &VALIDATE},
+	{"validate_tol", 'd', &VALIDATE_TOL},
+	{"checkpoint_interval", 'i', &CHECKPOINT_INTERVAL},
+	{"checkpoint_file", 's', &CHECKPOINT_FILE},
+	{"restart", 's', &RESTART},
+	{"ensemble", 'i', &ENSEMBLE},
+	{"ensemble_param", 's', &ENSEMBLE_PARAM},
+	{"ensemble_values", 's', &ENSEMBLE_VALUES},
+	{"device", 'b', &DEVICE},
+	{"monitor_shm", 's', &MONITOR_SHM},
+	{"monitor_interval", 'i', &MONITOR_INTERVAL},
+	{"monitor_nodes", 'i', &MONITOR_NODES},
+	{"monitor_slots", 'i', &MONITOR_SLOTS},
+	{"monitor_view", 'b', &MONITOR_VIEW},
+	{"benchmark", 'b', &BENCHMARK},
+	{"bench_np_min", 'i', &BENCH_NP_MIN},
+	{"bench_np_max", 'i', &BENCH_NP_MAX},
+	{"bench_nc_min", 'i', &BENCH_NC_MIN},
+	{"bench_nc_max", 'i', &BENCH_NC_MAX},
+	{"bench_gs_nc_max", 'i', &BENCH_GS_NC_MAX},
+	{"bench_reps", 'i', &BENCH_REPS},
+	{"bench_ref", 's', &BENCH_REF},
+	{"bench_write_ref", 'b', &BENCH_WRITE_REF},
+};
+
+/*Strip comments and surrounding white space*/
+string Trim(string str)
+{
+	size_t hash = str.find('#');
+	if(hash!=string::npos) str.erase(hash);
+	size_t first = str.find_first_not_of(" \t\r\n");
+	if(first==string::npos) return "";
+	size_t last = str.find_last_not_of(" \t\r\n");
+	return str.substr(first, last-first+1);
+}
+
+/*Trimmed items of a separated list, none for an empty text*/
+vector<string> Split(const string &text, char sep)
+{
+	vector<string> items;
+	size_t p = 0;
+	while(!text.empty() && p<=text.size())
+	{
+		size_t end = min(text.find(sep, p), text.size());
+		items.push_back(Trim(text.substr(p, end-p)));
+		p = end+1;
+	}
+	return items;
+}
+
+/*Set a global parameter from its key, returns false for unknown keys*/
+bool SetParam(const string &key, const string &value)
+{
+	for(auto &param:input_params)
+	{
+		if(key != param.key) continue;
+		switch(param.type)
+		{
+		case 'd': *(double*)param.ptr = atof(value.c_str()); break;
+		case 'i': *(int*)param.ptr = (int)atof(value.c_str()); break;
+		case 'b': *(bool*)param.ptr = (value=="1" || value=="true" || value=="yes"); break;
+		case 's': *(string*)param.ptr = value; break;
+		}
+		return true;
+	}
+	return false;
+}
+
+/*Set a key of a [species] block; the mass takes an optional unit (kg, amu, me) 
+and the charge is in units of the elementary charge*/
+bool SetSpeciesParam(SpeciesInput &sp, const string &key, const string &value)
+{
+	if(key=="name") sp.name = value;
+	else if(key=="num") sp.num = atoi(value.c_str());
+	else if(key=="temp") sp.temp = atof(value.c_str());
+	else if(key=="charge") sp.charge = atof(value.c_str())*QE;
+	else if(key=="subcycle") sp.subcycle = atoi(value.c_str());
+	else if(key=="vmax") sp.vmax = atof(value.c_str());
+	else if(key=="mass")
+	{
+		stringstream ss(value);
+		string unit = "kg";
+		ss >> sp.mass >> unit;
+		if(unit=="amu") sp.mass *= AMU;
+		else if(unit=="me") sp.mass *= ME;
+		else if(unit!="kg") return false;
+	}
+	else return false;
+	return true;
+}
+
+/*Parse "xmin:xmax,xmin:xmax" ranges, as fractions of the domain, into 
+regions (pairs of bounds)*/
+bool ParseRegions(const string &text, vector<double> &regions)
+{
+	regions.clear();
+	stringstream ss(text);
+	string item;
+	while(getline(ss, item, ','))
+	{
+		if(Trim(item).empty()) continue;
+		double xmin, xmax;
+		char colon;
+		stringstream is(item);
+		if(!(is >> xmin >> colon >> xmax) || colon!=':' || !(0<=xmin && xmin<xmax && xmax<=1)) 
+			return false;
+		regions.push_back(xmin);
+		regions.push_back(xmax);
+	}
+	return true;
+}
+
+/*Read the input deck given on the command line: "key = value" lines, with 
+[species] starting a new species block. Arguments of the form key=value 
+override the deck, so one binary can run a whole parameter scan*/
+void ReadInput(int argc, char *argv[], vector<SpeciesInput> &species_input)
+{
+	vector<string> overrides;
+	for(int a=1; a<argc; a++)
+	{
+		string arg = argv[a];
+		if(arg.find('=')!=string::npos)
+		{
+			overrides.push_back(arg);
+			continue;
+		}
+		
+		ifstream deck(arg);
+		if(!deck.is_open())
+		{
+			printf("Unable to open input deck %s\n", arg.c_str());
+			exit(-1);
+		}
+		
+		string line;
+		int line_num = 0;
+		SpeciesInput *sp = NULL;
+		while(getline(deck, line))
+		{
+			line_num++;
+			line = Trim(line);
+			if(line.empty()) continue;
+			if(line=="[species]")
+			{
+				species_input.push_back({"Species", AMU, QE, NUM_IONS, ION_TEMP});
+				sp = &species_input.back();
+				continue;
+			}
+			
+			size_t eq = line.find('=');
+			string key = (eq==string::npos)?line:Trim(line.substr(0,eq));
+			string value = (eq==string::npos)?"":Trim(line.substr(eq+1));
+			bool ok = (eq!=string::npos) && (sp?SetSpeciesParam(*sp,key,value):SetParam(key,value));
+			if(!ok)
+			{
+				printf("%s:%i: invalid input \"%s\"\n", arg.c_str(), line_num, line.c_str());
+				exit(-1);
+			}
+		}
+	}
+	
+	for(auto &arg:overrides)
+	{
+		size_t eq = arg.find('=');
+		if(!SetParam(Trim(arg.substr(0,eq)), Trim(arg.substr(eq+1))))
+		{
+			printf("Unknown parameter %s\n", arg.c_str());
+			exit(-1);
+		}
+	}
+	
+	if(STEADY_ACTION!="stop" && STEADY_ACTION!="average" && STEADY_ACTION!="report")
+	{
+		printf("Unknown steady_action %s, use stop, average or report\n", STEADY_ACTION.c_str());
+		exit(-1);
+	}
+	FieldSolver::Method method;
+	if(!FieldSolver::MethodFromName(FIELD_SOLVER, &method))
+	{
+		printf("Unknown field_solver %s, use direct, gs, multigrid or pcr\n", FIELD_SOLVER.c_str());
+		exit(-1);
+	}
+	if(MG_MAX_CYCLES<1 || MG_SWEEPS<1)
+	{
+		printf("mg_max_cycles and mg_sweeps must be positive\n");
+		exit(-1);
+	}
+	if(BOLTZMANN_ELECTRONS && (BOLTZMANN_RELAX<1 || NEWTON_MAX_ITER<1 || NEWTON_TOL<=0 || ELECTRON_TEMP<=0))
+	{
+		printf("boltzmann_relax, newton_max_iter, newton_tol and electron_temp must be positive\n");
+		exit(-1);
+	}
+	if(PHASE_SPACE && (PS_NX<1 || PS_NV<1 || PS_STRIDE<1 || PS_VMAX<=0))
+	{
+		printf("ps_nx, ps_nv, ps_stride and ps_vmax must be positive\n");
+		exit(-1);
+	}
+	vector<double> regions;
+	if(PHASE_SPACE && !ParseRegions(VDF_REGIONS, regions))
+	{
+		printf("Invalid vdf_regions \"%s\", use xmin:xmax pairs within 0..1 separated by commas\n", 
+			VDF_REGIONS.c_str());
+		exit(-1);
+	}
+	if(MCC && (NEUTRAL_DEN<0 || NEUTRAL_TEMP<0 || NEUTRAL_MASS<=0))
+	{
+		printf("neutral_den and neutral_temp must not be negative, neutral_mass must be positive\n");
+		exit(-1);
+	}
+	if(!VALIDATE.empty() && !AVERAGE)
+	{
+		printf("validate compares the time averaged profiles, set average=true\n");
+		exit(-1);
+	}
+	if(PARTICLE_INTERVAL<0 || PARTICLE_CHUNK<1)
+	{
+		printf("particle_interval must not be negative and particle_chunk must be positive\n");
+		exit(-1);
+	}
+	if(AVERAGE_STRIDE<1 || AVERAGE_WINDOW<0)
+	{
+		printf("average_stride must be positive and average_window not negative\n");
+		exit(-1);
+	}
+	if(ADAPTIVE_DIAG && STEADY_CHECK<=0)
+	{
+		printf("adaptive_diag paces the dumps with the steady state detector, set steady_check\n");
+		exit(-1);
+	}
+	if(STEADY_CHECK>0 && STEADY_WINDOW<4)
+	{
+		printf("steady_window needs at least 4 samples\n");
+		exit(-1);
+	}
+	
+	if(SOURCE && !(0<=SOURCE_XMIN && SOURCE_XMIN<SOURCE_XMAX && SOURCE_XMAX<=1))
+	{
+		printf("The source region must satisfy 0 <= source_xmin < source_xmax <= 1\n");
+		exit(-1);
+	}
+#ifndef PICS_DEVICE
+	if(DEVICE)
+	{
+		printf("device=true needs a build with -DPICS_DEVICE\n");
+		exit(-1);
+	}
+#endif
+	vector<string> values = Split(ENSEMBLE_VALUES, ',');
+	if(!ENSEMBLE_PARAM.empty())
+	{
+		const char *varied[] = {"plasma_den", "electron_temp", "ion_temp", "num_ions", "num_electrons"};
+		bool known = false;
+		for(const char *key:varied)
+			known |= (ENSEMBLE_PARAM==key);
+		if(!known)
+		{
+			printf("ensemble_param %s can not vary, use plasma_den, electron_temp, ion_temp, num_ions or num_electrons\n", 
+				ENSEMBLE_PARAM.c_str());
+			exit(-1);
+		}
+		if(ENSEMBLE==0) ENSEMBLE = values.size();
+		if((int)values.size()!=ENSEMBLE)
+		{
+			printf("ensemble_values needs one value of %s for each of the %i members\n", 
+				ENSEMBLE_PARAM.c_str(), ENSEMBLE);
+			exit(-1);
+		}
+	}
+	if(ENSEMBLE<0)
+	{
+		printf("ensemble must not be negative\n");
+		exit(-1);
+	}
+	if(ENSEMBLE>0 && (DEVICE || PHASE_SPACE || STEADY_CHECK>0 || AVERAGE || SORT_INTERVAL>0 || 
+		CHECKPOINT_INTERVAL>0 || !RESTART.empty() || FIELD_SOLVER!="direct" || PARTICLE_INTERVAL>0))
+	{
+		printf("ensemble runs with the direct field solver and without device, phase_space, "
+			"steady_check, average, sort_interval, particle_interval and checkpoints\n");
+		exit(-1);
+	}
+	if(!MONITOR_SHM.empty() && (MONITOR_INTERVAL<1 || MONITOR_NODES<1 || MONITOR_SLOTS<1))
+	{
+		printf("monitor_interval, monitor_nodes and monitor_slots must be positive\n");
+		exit(-1);
+	}
+	if(MESH_STRETCH<1)
+	{
+		printf("mesh_stretch must be at least 1\n");
+		exit(-1);
+	}
+	if(MESH_STRETCH>1 && (DEVICE || ENSEMBLE>0 || BENCHMARK || FIELD_SOLVER=="gs" || FIELD_SOLVER=="multigrid"))
+	{
+		printf("mesh_stretch runs with the direct or pcr field solver, without device, ensemble and benchmark\n");
+		exit(-1);
+	}
+	if(BOLTZMANN_ELECTRONS && (DEVICE || ENSEMBLE>0))
+	{
+		printf("boltzmann_electrons runs without device and ensemble\n");
+		exit(-1);
+	}
+	if(DEVICE && (MCC || SOURCE || PHASE_SPACE || SORT_INTERVAL>0))
+	{
+		printf("device=true runs without mcc, source, phase_space and sort_interval\n");
+		exit(-1);
+	}
+}
+
+/*Initialize the particle data : initial positions and velocities of each particle*/
+void Init(Species *species)
+{
+	double xmin = 0, width = domain.xl;
+	int num = decomp.Share(species->NUM, xmin, width);
+	LoadParticles(species, num, xmin, width);
+}
+
+/*Inject num particles uniformly in the source region with a thermal velocity 
+distribution, into the slots freed at the end of the particle arrays. With MPI 
+the losses of all ranks are refilled, each rank in its part of the region*/
+void InjectSpecies(Species *species, int num)
+{
+	double lost = num;
+	decomp.Sum(&lost, 1);
+	double xmin = SOURCE_XMIN*domain.xl, width = (SOURCE_XMAX-SOURCE_XMIN)*domain.xl;
+	num = decomp.Share((int)lost, xmin, width);
+	if(num<=0) return;
+	LoadParticles(species, num, xmin, width);
+}
+
+/*Append num particles uniform in [xmin, xmin+width) with a Maxwellian 
+velocity. Each thread fills its own chunk in batches of deviates drawn 
+from its own random stream*/
+void LoadParticles(Species *species, int num, double xmin, double width)
+{
+	ParticleArray &part = species->part_list;
+	int first = part.size();
+	int first_id = species->add_ids(num);
+	part.resize(first+num);
+	double v_th = sqrt(K*species->Temp*EV_TO_K/species->mass);
+	
+	#pragma omp parallel
+	{
+		RandomStream &rng = rng_streams[omp_get_thread_num()];
+		double u[RandomStream::BATCH], g[RandomStream::BATCH];
+		int start, end;
+		ThreadRange(num, &start, &end);
+		for(int b=start; b<end; b+=RandomStream::BATCH)
+		{
+			int n = min(RandomStream::BATCH, end-b);
+			rng.Fill(u, n);
+			rng.FillNormal(g, n);
+			for(int k=0; k<n; k++)
+			{
+				part.pos[first+b+k] = xmin + u[k]*width;
+				part.vel[first+b+k] = v_th*g[k];
+				part.id[first+b+k] = first_id+b+k;
+			}
+		}
+	}
+}
+
+/*Sample one velocity component of a Maxwellian at temperature T (K)*/
+double SampleVel(double T, double mass)
+{
+	return sqrt(K*T/mass)*rng_streams[omp_get_thread_num()].Normal();
+}
+
+/*Logical coordinate on the stretched mesh*/
+static inline double MeshToL(double pos)
+{
+	return domain.lookup.ToL(pos);
+}
+
+/*Covert the physical coordinate to the logical coordinate*/
+double XtoL(double pos)
+{
+	if(!domain.uniform) return MeshToL(pos);
+	double li = (pos-domain.x0)/domain.dx;
+	return li;
+}
+
+/*Position of node i of the whole domain*/
+double NodeX(int i)
+{
+	return domain.uniform?i*domain.dx:domain.xn[i];
+}
+
+/*Divide the deposits of field by the node volumes, the wall nodes own half 
+a cell*/
+void DivideByVolume(double *field)
+{
+	if(!domain.uniform)
+	{
+		for(int i=0; i<domain.ni; i++)
+			field[i] /= domain.volume[i];
+		return;
+	}
+	for(int i=0; i<domain.ni; i++)
+		field[i] /=domain.dx;
+	
+	field[0] *=2.0;
+	field[domain.ni-1] *= 2.0;
+}
+
+/*Arena bytes of the private grids and spans of all threads*/
+size_t ThreadGridBytes()
+{
+	size_t nt = omp_get_max_threads();
+	return Arena::Bytes<double>(nt*grid_slots*Arena::Bytes<double>(domain.ni)/sizeof(double)) + 
+		Arena::Bytes<int>(nt*span_stride);
+}
+
+/*Take the per-thread private grids, grid_slots grids for each thread, from 
+the arena; each grid is whole cache lines*/
+void AllocThreadGrids()
+{
+	size_t nt = omp_get_max_threads();
+	grid_stride = Arena::Bytes<double>(domain.ni)/sizeof(double);
+	thread_grids = arena.Take<double>(nt*grid_slots*grid_stride);
+	grid_span = arena.Take<int>(nt*span_stride);
+	for(size_t t=0; t<nt; t++)
+		for(int slot=0; slot<grid_slots; slot++)
+		{
+			grid_span[t*span_stride + 2*slot] = domain.ni;
+			grid_span[t*span_stride + 2*slot+1] = -1;
+		}
+}
+
+/*Private grid of the calling thread for the given slot, clean for deposit*/
+double *ThreadGrid(int slot)
+{
+	return &thread_grids[((size_t)omp_get_thread_num()*grid_slots + slot)*grid_stride];
+}
+
+/*Record the logical coordinates the calling thread deposited from; pass 
+lc_min > lc_max when it deposited nothing*/
+void MarkThreadGrid(int slot, double lc_min, double lc_max)
+{
+	int *span = &grid_span[omp_get_thread_num()*span_stride + 2*slot];
+	if(lc_min>lc_max) return;
+	// widest stencil: TSC reaches one node below and CIC one above the cell
+	span[0] = max(0, min(span[0], (int)lc_min-1));
+	span[1] = min(domain.ni-1, max(span[1], (int)lc_max+2));
+}
+
+/*Sum the private grids of all threads for the given slot into field, then 
+clear the spans the threads touched*/
+void ReduceThreadGrids(double *field, int slot)
+{
+	int nt = omp_get_max_threads();
+	#pragma omp parallel for
+	for(int i=0; i<domain.ni; i++)
+	{
+		double sum = 0;
+		for(int t=0; t<nt; t++)
+		{
+			int *span = &grid_span[t*span_stride + 2*slot];
+			if(i>=span[0] && i<=span[1])
+				sum += thread_grids[((size_t)t*grid_slots + slot)*grid_stride + i];
+		}
+		field[i] = sum;
+	}
+	
+	#pragma omp parallel for
+	for(int t=0; t<nt; t++)
+	{
+		int *span = &grid_span[t*span_stride + 2*slot];
+		if(span[0]<=span[1])
+			memset(&thread_grids[((size_t)t*grid_slots + slot)*grid_stride + span[0]], 0, 
+				sizeof(double)*(span[1]-span[0]+1));
+		span[0] = domain.ni;
+		span[1] = -1;
+	}
+}
+
+/*scatter the particle data to the mesh and collect the densities at the mesh */
+template<int ORDER> inline void scatter(double lc, double value, double *field)
+{
+	Shape<ORDER>::Scatter(lc,value,field,domain.ni);
+}
+
+/* Gather field values at logical coordinates*/
+template<int ORDER> inline double gather(double lc, const double *field)
+{
+	return Shape<ORDER>::Gather(lc,field,domain.ni);
+}
+
+/*Scatter the particles to the mesh for evaluating densities*/
+void ScatterSpecies(Species *species, double *field)
+{
+	SHAPE_DISPATCH(ScatterSpeciesShape, species, field);
+}
+
+template<int ORDER> void ScatterSpeciesShape(Species *species, double *field)
+{
+	/*scatter particles to the private mesh of each thread*/
+	ParticleArray &part = species->part_list;
+	#pragma omp parallel
+	{
+		double *grid = ThreadGrid(0);
+		double lc_min = domain.ni, lc_max = -1;
+		int start, end;
+		ThreadRange(part.size(), &start, &end);
+		for(int p=start; p<end; p++)
+		{
+			double lc = XtoL(part.pos[p]);
+			scatter<ORDER>(lc,species->spwt,grid);
+			lc_min = min(lc_min, lc);
+			lc_max = max(lc_max, lc);
+		}
+		MarkThreadGrid(0, lc_min, lc_max);
+	}
+	ReduceThreadGrids(field, 0);
+	decomp.SumGhosts(&field, 1);
+	
+	/*divide by cell volume*/
+	DivideByVolume(field);
+}
+
+/*Scatter the particles to the mesh for evaluating velocities*/
+void ScatterSpeciesVel(Species *species, double *field)
+{
+	SHAPE_DISPATCH(ScatterSpeciesVelShape, species, field);
+}
+
+template<int ORDER> void ScatterSpeciesVelShape(Species *species, double *field)
+{
+	/*scatter particles to the private mesh of each thread*/
+	ParticleArray &part = species->part_list;
+	#pragma omp parallel
+	{
+		double *grid = ThreadGrid(0);
+		double lc_min = domain.ni, lc_max = -1;
+		int start, end;
+		ThreadRange(part.size(), &start, &end);
+		for(int p=start; p<end; p++)
+		{
+			double lc = XtoL(part.pos[p]);
+			scatter<ORDER>(lc,species->spwt*part.vel[p],grid);
+			lc_min = min(lc_min, lc);
+			lc_max = max(lc_max, lc);
+		}
+		MarkThreadGrid(0, lc_min, lc_max);
+	}
+	ReduceThreadGrids(field, 0);
+	decomp.SumGhosts(&field, 1);
+	
+	/*divide by cell volume*/
+	DivideByVolume(field);
+}
+
+/*Scatter the particles to the mesh for evaluating densities, velocities and 
+optionally temperatures (in eV) in a single pass over the particles*/
+void ScatterSpeciesMoments(Species *species, double *den, double *vel, double *temp)
+{
+	SHAPE_DISPATCH(ScatterSpeciesMomentsShape, species, den, vel, temp);
+}
+
+template<int ORDER> void ScatterSpeciesMomentsShape(Species *species, double *den, double *vel, double *temp)
+{
+	/*scatter particles to the private meshes of each thread*/
+	ParticleArray &part = species->part_list;
+	double spwt = species->spwt;
+	int ni = domain.ni;
+	#pragma omp parallel
+	{
+		double *den_t = ThreadGrid(0);
+		double *vel_t = ThreadGrid(1);
+		double *temp_t = temp?ThreadGrid(2):NULL;
+		double lc_min = ni, lc_max = -1;
+		int start, end;
+		ThreadRange(part.size(), &start, &end);
+		for(int p=start; p<end; p++)
+		{
+			double lc = XtoL(part.pos[p]);
+			double v = part.vel[p];
+			
+			Shape<ORDER>::Scatter(lc,spwt,den_t,ni);
+			Shape<ORDER>::Scatter(lc,spwt*v,vel_t,ni);
+			if(temp_t) Shape<ORDER>::Scatter(lc,spwt*v*v,temp_t,ni);
+			lc_min = min(lc_min, lc);
+			lc_max = max(lc_max, lc);
+		}
+		MarkThreadGrid(0, lc_min, lc_max);
+		MarkThreadGrid(1, lc_min, lc_max);
+		if(temp_t) MarkThreadGrid(2, lc_min, lc_max);
+	}
+	ReduceThreadGrids(den, 0);
+	ReduceThreadGrids(vel, 1);
+	if(temp) ReduceThreadGrids(temp, 2);
+	double *moments[] = {den, vel, temp};
+	decomp.SumGhosts(moments, temp?3:2);
+	
+	/*temperature from the second moment: m(<v^2>-<v>^2)/e */
+	if(temp)
+	{
+		for(int i=0; i<domain.ni; i++)
+		{
+			if(den[i]>0)
+			{
+				double v_mean = vel[i]/den[i];
+				temp[i] = species->mass*(temp[i]/den[i] - v_mean*v_mean)/QE;
+			}
+			else
+				temp[i] = 0;
+		}
+	}
+	
+	/*divide by cell volume*/
+	DivideByVolume(den);
+	DivideByVolume(vel);
+}
+
+//*******************************************************
+/*Gather, accelerate and move the particles in [0,np), flagging the ones 
+leaving the domain so the loop body is free of branches and vectorizes. The 
+gather from the double fields is done in double, the particle update in the 
+particle precision. The exit test is in double: a float xmax can round above 
+the wall, and a particle kept between the two would gather past the last node*/
+template<int ORDER> static inline __attribute__((always_inline)) void push_kernel_body(
+	PartReal *pos, PartReal *vel, unsigned char *flag, int np, const double *ef, int ni, 
+	double x0, double dx, double xmax, double dt_qm, double dt)
+{
+	const PartReal dt_p = dt;
+	#pragma omp simd
+	for(int p=0; p<np; p++)
+	{
+		double part_ef = Shape<ORDER>::Gather((pos[p]-x0)/dx,ef,ni);
+		vel[p] += (PartReal)(dt_qm*part_ef);
+		pos[p] += dt_p*vel[p];
+		flag[p] = (pos[p] < x0) | (pos[p] >= xmax);
+	}
+}
+
+/*push_kernel_body on a stretched mesh, the cell from the lookup tables. The 
+kernels keep the PushKernel interface, with its uniform dx left unnamed*/
+template<int ORDER> static inline __attribute__((always_inline)) void push_kernel_mapped_body(
+	PartReal *pos, PartReal *vel, unsigned char *flag, int np, const double *ef, int ni, 
+	double x0, double xmax, double dt_qm, double dt)
+{
+	const PartReal dt_p = dt;
+	const MeshLookup map = domain.lookup;
+	#pragma omp simd
+	for(int p=0; p<np; p++)
+	{
+		double part_ef = Shape<ORDER>::Gather(map.ToL(pos[p]),ef,ni);
+		vel[p] += (PartReal)(dt_qm*part_ef);
+		pos[p] += dt_p*vel[p];
+		flag[p] = (pos[p] < x0) | (pos[p] >= xmax);
+	}
+}
+
+template<int ORDER> void PushKernelMapped(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double /*dx*/, double xmax, double dt_qm, double dt)
+{
+	push_kernel_mapped_body<ORDER>(pos,vel,flag,np,ef,ni,x0,xmax,dt_qm,dt);
+}
+
+PushKernel push_kernels_mapped[3] = {PushKernelMapped<0>, PushKernelMapped<1>, PushKernelMapped<2>};
+
+#if defined(__GNUC__) && defined(__x86_64__)
+template<int ORDER> __attribute__((target("avx512f,avx512dq,prefer-vector-width=512")))
+void PushKernelAVX512(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double dx, double xmax, double dt_qm, double dt)
+{
+	push_kernel_body<ORDER>(pos,vel,flag,np,ef,ni,x0,dx,xmax,dt_qm,dt);
+}
+
+template<int ORDER> __attribute__((target("avx2,fma")))
+void PushKernelAVX2(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double dx, double xmax, double dt_qm, double dt)
+{
+	push_kernel_body<ORDER>(pos,vel,flag,np,ef,ni,x0,dx,xmax,dt_qm,dt);
+}
+
+template<int ORDER> __attribute__((target("avx512f,avx512dq,prefer-vector-width=512")))
+void PushKernelMappedAVX512(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double /*dx*/, double xmax, double dt_qm, double dt)
+{
+	push_kernel_mapped_body<ORDER>(pos,vel,flag,np,ef,ni,x0,xmax,dt_qm,dt);
+}
+
+template<int ORDER> __attribute__((target("avx2,fma")))
+void PushKernelMappedAVX2(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double /*dx*/, double xmax, double dt_qm, double dt)
+{
+	push_kernel_mapped_body<ORDER>(pos,vel,flag,np,ef,ni,x0,xmax,dt_qm,dt);
+}
+
+/* Kernels for each shape order*/
+PushKernel push_kernels_avx512[3] = {PushKernelAVX512<0>, PushKernelAVX512<1>, PushKernelAVX512<2>};
+PushKernel push_kernels_avx2[3] = {PushKernelAVX2<0>, PushKernelAVX2<1>, PushKernelAVX2<2>};
+PushKernel push_kernels_mapped_avx512[3] = {PushKernelMappedAVX512<0>, PushKernelMappedAVX512<1>, PushKernelMappedAVX512<2>};
+PushKernel push_kernels_mapped_avx2[3] = {PushKernelMappedAVX2<0>, PushKernelMappedAVX2<1>, PushKernelMappedAVX2<2>};
+#endif
+
+
+/*Pick the requested push kernel, or with "auto" the widest vector kernel the 
+CPU supports. NULL selects the scalar push. A stretched mesh takes the 
+mapped variant of the kernel*/
+PushKernel SelectPushKernel(const char *request, int order, const char **name)
+{
+	string req = request;
+	if(order<0 || order>2)
+	{
+		printf("Unsupported shape order %i\n", order);
+		exit(-1);
+	}
+	if(req!="auto" && req!="scalar" && req!="avx2" && req!="avx512")
+	{
+		printf("Unknown push kernel %s, using auto\n", request);
+		req = "auto";
+	}
+	bool mapped = !domain.uniform;
+#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	bool has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+	bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if(has_avx512 && (req=="auto" || req=="avx512"))
+	{
+		*name = mapped?"avx512 mapped":"avx512";
+		return (mapped?push_kernels_mapped_avx512:push_kernels_avx512)[order];
+	}
+	if(has_avx2 && req!="scalar")
+	{
+		*name = mapped?"avx2 mapped":"avx2";
+		return (mapped?push_kernels_mapped_avx2:push_kernels_avx2)[order];
+	}
+#endif
+	if(mapped)
+	{
+		*name = "scalar mapped";
+		return push_kernels_mapped[order];
+	}
+	*name = "scalar";
+	return NULL;
+}
+
+/*Push a species, and with phase_space bin species s of it after the push*/
+void PushSpecies(Species *species, double *ef, PhaseSpace *phase_space, int s)
+{
+	if(push_kernel == NULL) 
+	{
+		SHAPE_DISPATCH(PushSpeciesScalar, species, ef);
+		if(phase_space)
+		{
+			ParticleArray &part = species->part_list;
+			#pragma omp parallel
+			{
+				int start, end;
+				ThreadRange(part.size(), &start, &end);
+				phase_space->Bin(s, part.pos.data()+start, part.vel.data()+start, NULL, end-start);
+			}
+			phase_space->Reduce(s);
+		}
+		return;
+	}
+	
+	double qm = species->charge/species->mass; 
+	double dt = DT*species->subcycle;
+	ParticleArray &part = species->part_list;
+	int np = part.size();
+	part.flag.resize(np);
+	
+	// vectorized push of each thread's chunk, then compact out the 
+	// particles leaving the domain. When binning the phase space the chunk 
+	// is pushed in blocks, each binned while it is still in cache
+	#pragma omp parallel
+	{
+		int start, end;
+		ThreadRange(np, &start, &end);
+		int block = phase_space?4096:max(end-start,1);
+		for(int b=start; b<end; b+=block)
+		{
+			int n = min(block, end-b);
+			push_kernel(part.pos.data()+b, part.vel.data()+b, part.flag.data()+b, 
+				n, ef, domain.ni, domain.x0, domain.dx, domain.xmax, dt*qm, dt);
+			if(phase_space) 
+				phase_space->Bin(s, part.pos.data()+b, part.vel.data()+b, part.flag.data()+b, n);
+		}
+	}
+	if(phase_space) phase_space->Reduce(s);
+	
+	/*decomposed, the kernels flag the particles leaving the local nodes; the 
+	ones still between the walls migrate to the neighbours instead*/
+	if(decomp.size>1)
+		for(int p=0; p<np; p++)
+			if(part.flag[p]) part.flag[p] = (part.pos[p] < 0) | (part.pos[p] >= domain.xl);
+	part.remove_flagged();
+}
+
+/*Scalar particle push*/
+template<int ORDER> void PushSpeciesScalar(Species *species, double *ef)
+{
+	// compute charge to mass ratio
+	double qm = species->charge/species->mass; 
+	double dt = DT*species->subcycle;
+	ParticleArray &part = species->part_list;
+	int p = 0;
+	
+	// loop over particles
+	while (p<part.size())
+	{
+		// compute particle node position
+		double lc = XtoL(part.pos[p]);
+		
+		// gather electric field onto particle position
+		double part_ef = gather<ORDER>(lc,ef);
+		
+		// advance velocity
+		part.vel[p] += (PartReal)(dt*qm*part_ef);
+
+		// Advance particle position 
+		part.pos[p] += (PartReal)dt*part.vel[p]; 
+
+		// Remove the particles reaching the walls, the ones leaving the 
+		// local nodes of a decomposed run migrate to the neighbours
+		if(part.pos[p] < 0 || part.pos[p] >= domain.xl)
+		{
+			// swap the last particle into this slot and process it next
+			part.remove(p);
+			
+			/* Encountering Steady state*/
+			//part.pos = (domain.xl - domain.x0)/2; // relocate the particle in the middle of the domain
+			//part.pos = domain.x0 + rnd()*(domain.ni - 1)*domain.dx;
+			//cout << (domain.x0+(domain.ni/100)*domain.dx) << endl;
+			//part.pos = (domain.x0+(domain.ni/100)*domain.dx) + rnd()*domain.xl-((domain.ni/100)*domain.dx);
+			//part.vel = SampleVel(species->Temp*EV_TO_K, species->mass);
+			//species->add(Particle(part.pos,part.vel));
+			
+			continue;
+		}
+		else
+			p++;			
+	}
+}
+//*********************************************************
+/*Rewind particle velocities by half a (species) time step */
+void RewindSpecies(Species *species, double *ef)
+{
+	SHAPE_DISPATCH(RewindSpeciesShape, species, ef);
+}
+
+template<int ORDER> void RewindSpeciesShape(Species *species, double *ef)
+{
+	// compute charge to mass ratio
+	double qm = species->charge/species->mass; 
+	ParticleArray &part = species->part_list;
+	#pragma omp parallel for
+	for(int p=0; p<part.size(); p++)
+	{
+		// compute particle node position
+		double lc = XtoL(part.pos[p]);
+		// gather electric field onto the particle position
+		double part_ef = gather<ORDER>(lc,ef);
+		//advance velocity
+		part.vel[p] -= 0.5*DT*species->subcycle*qm*part_ef;
+	}
+}
+
+void PhaseSpace::Init(vector<Species> &species_list, const vector<double> &region_fractions)
+{
+	nx = PS_NX;
+	nv = PS_NV;
+	x0 = 0;
+	dx_bin = domain.xl/nx;
+	nreg = region_fractions.size()/2;
+	regions.resize(2*nreg);
+	for(int r=0; r<2*nreg; r++)
+		regions[r] = region_fractions[r]*domain.xl;
+	
+	/*symmetric velocity range, ps_vmax thermal speeds unless the species sets one*/
+	int ns = species_list.size();
+	vmin.resize(ns);
+	dv.resize(ns);
+	for(int s=0; s<ns; s++)
+	{
+		Species &sp = species_list[s];
+		double vmax = sp.vmax>0?sp.vmax:PS_VMAX*sqrt(K*sp.Temp*EV_TO_K/sp.mass);
+		vmin[s] = -vmax;
+		dv[s] = 2*vmax/nv;
+	}
+	
+	size = (nx+nreg)*nv;
+	hist.resize(ns);
+	for(auto &h:hist) h = arena.Take<double>(size);
+	samples.assign(ns, 0);
+	binned.assign(ns, 0);
+	outside.assign(ns, 0);
+	thread_hist.resize(omp_get_max_threads());
+	for(auto &h:thread_hist) h = arena.Take<double>(size+2);
+}
+
+size_t PhaseSpace::ArenaBytes(int ns, int nreg)
+{
+	size_t size = (PS_NX+nreg)*PS_NV;
+	return ns*Arena::Bytes<double>(size) + omp_get_max_threads()*Arena::Bytes<double>(size+2);
+}
+
+void PhaseSpace::Reset()
+{
+	for(auto &h:hist)
+		memset(h, 0, sizeof(double)*size);
+	std::fill(samples.begin(), samples.end(), 0);
+}
+
+/*Particles outside the velocity range are not counted*/
+void PhaseSpace::Bin(int s, const PartReal *pos, const PartReal *vel, const unsigned char *flag, int np)
+{
+	double *h = thread_hist[omp_get_thread_num()];
+	double *vdf = h + nx*nv;
+	double inv_dx = 1/dx_bin, inv_dv = 1/dv[s], v0 = vmin[s];
+	int num_outside = 0, num_binned = 0;
+	for(int p=0; p<np; p++)
+	{
+		if(flag && flag[p]) continue;
+		int iv = (int)floor((vel[p]-v0)*inv_dv);
+		if(iv<0 || iv>=nv) {num_outside++; continue;}
+		num_binned++;
+		int ix = min((int)((pos[p]-x0)*inv_dx), nx-1);
+		h[ix*nv+iv] += 1;
+		for(int r=0; r<nreg; r++)
+			if(pos[p]>=regions[2*r] && pos[p]<regions[2*r+1])
+				vdf[r*nv+iv] += 1;
+	}
+	h[size] += num_binned;
+	h[size+1] += num_outside;
+}
+
+void PhaseSpace::Reduce(int s)
+{
+	double *sum = hist[s];
+	for(double *h:thread_hist)
+	{
+		for(int k=0; k<size; k++)
+			sum[k] += h[k];
+		binned[s] += h[size];
+		outside[s] += h[size+1];
+		memset(h, 0, sizeof(double)*(size+2));
+	}
+	samples[s]++;
+}
+
+void CrossSection::Tabulate(const vector<double> &energy, const vector<double> &sigma)
+{
+	log_emin = log(EMIN);
+	inv_dlog = (NE-1)/(log(EMAX)-log_emin);
+	table.resize(NE);
+	size_t k = 0;
+	for(int i=0; i<NE; i++)
+	{
+		double e = Energy(i);
+		while(k+1<energy.size() && energy[k+1]<=e) k++;
+		if(e<=energy[0]) table[i] = sigma[0];
+		else if(k+1>=energy.size()) table[i] = sigma.back();
+		else
+		{
+			double w = log(e/energy[k])/log(energy[k+1]/energy[k]);
+			table[i] = sigma[k] + w*(sigma[k+1]-sigma[k]);
+		}
+	}
+}
+
+/*Read a cross section file: energy (eV) and cross section (m^2) per line, in 
+increasing energy, '#' starts a comment*/
+bool ReadCrossSection(const string &name, vector<double> &energy, vector<double> &sigma)
+{
+	ifstream in(name);
+	if(!in.is_open())
+	{
+		printf("Unable to open cross section file %s\n", name.c_str());
+		return false;
+	}
+	energy.clear();
+	sigma.clear();
+	string line;
+	while(getline(in, line))
+	{
+		line = Trim(line.substr(0, line.find('#')));
+		if(line.empty()) continue;
+		double e, s;
+		stringstream ss(line);
+		if(!(ss >> e >> s) || e<=0 || s<0 || (!energy.empty() && e<=energy.back()))
+		{
+			printf("%s: invalid line \"%s\"\n", name.c_str(), line.c_str());
+			return false;
+		}
+		energy.push_back(e);
+		sigma.push_back(s);
+	}
+	if(energy.empty()) printf("%s has no data\n", name.c_str());
+	return !energy.empty();
+}
+
+/*Approximate argon data (eV, 1e-20 m^2): electron elastic momentum transfer 
+with the Ramsauer minimum, and Ar+ on Ar elastic (isotropic part) and charge 
+exchange in the lab frame of the neutral. Use measured data files for 
+quantitative work*/
+static const double XS_E_ELASTIC_DATA[][2] = {{0.001,7.5},{0.01,4.2},{0.05,1.7},{0.1,0.9},
+	{0.2,0.2},{0.23,0.1},{0.3,0.17},{0.5,0.45},{1,1.4},{2,3.0},{3,4.4},{5,7.0},{10,15},
+	{15,14},{20,11},{30,8},{50,5.5},{100,3.0},{200,1.7},{500,0.8},{1000,0.45},{10000,0.06}};
+static const double XS_I_ELASTIC_DATA[][2] = {{0.01,150},{0.1,60},{1,30},{10,18},{100,11},
+	{1000,7},{10000,4}};
+static const double XS_I_CX_DATA[][2] = {{0.01,75},{0.1,65},{1,55},{10,45},{100,37},
+	{1000,30},{10000,24}};
+
+/*Tabulate the built-in data, or the file if one is given*/
+static void SetCrossSection(CrossSection &xs, const string &file, const double (*data)[2], int n)
+{
+	vector<double> energy, sigma;
+	if(!file.empty())
+	{
+		if(!ReadCrossSection(file, energy, sigma)) exit(-1);
+	}
+	else
+		for(int k=0; k<n; k++)
+		{
+			energy.push_back(data[k][0]);
+			sigma.push_back(data[k][1]*1e-20);
+		}
+	xs.Tabulate(energy, sigma);
+}
+
+void MonteCarloCollisions::Init(vector<Species> &species_list)
+{
+	SetCrossSection(e_elastic, XS_E_ELASTIC, XS_E_ELASTIC_DATA, sizeof(XS_E_ELASTIC_DATA)/sizeof(XS_E_ELASTIC_DATA[0]));
+	SetCrossSection(i_elastic, XS_I_ELASTIC, XS_I_ELASTIC_DATA, sizeof(XS_I_ELASTIC_DATA)/sizeof(XS_I_ELASTIC_DATA[0]));
+	SetCrossSection(i_cx, XS_I_CX, XS_I_CX_DATA, sizeof(XS_I_CX_DATA)/sizeof(XS_I_CX_DATA[0]));
+	
+	neutral_mass = NEUTRAL_MASS*AMU;
+	vth_neutral = sqrt(K*NEUTRAL_TEMP*EV_TO_K/neutral_mass);
+	
+	/*the largest total collision frequency up to each table energy; nu_max 
+	is set from it once the particles are loaded, in the first Collide*/
+	targets.resize(species_list.size());
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		Species &sp = species_list[s];
+		Target &t = targets[s];
+		t.mass = sp.mass;
+		t.candidates = t.elastic = t.cx = 0;
+		t.g_max = t.nu_max = t.p_null = 0;
+		if(sp.charge<0 && sp.mass<1e-3*neutral_mass) t.kind = ELECTRON;
+		else if(sp.charge>0 && fabs(sp.mass-neutral_mass)<0.1*neutral_mass) t.kind = ION;
+		else t.kind = NONE;
+		
+		t.nu.assign(CrossSection::NE, 0);
+		for(int i=0; i<CrossSection::NE && t.kind!=NONE; i++)
+		{
+			double energy = e_elastic.Energy(i);
+			double speed = sqrt(2*QE*energy/sp.mass);
+			double sigma = (t.kind==ELECTRON)?e_elastic.Lookup(energy):
+				i_elastic.Lookup(energy)+i_cx.Lookup(energy);
+			t.nu[i] = max(i>0?t.nu[i-1]:0, NEUTRAL_DEN*sigma*speed);
+		}
+		
+		if(t.kind==NONE) printf("MCC: %s does not collide\n", sp.name.c_str());
+	}
+}
+
+/*The cross sections are linear in log(energy) between the table points, so 
+the frequency up to the table point above the energy of g_max bounds it*/
+void MonteCarloCollisions::SetNuMax(Target &t, double g_max, Species *species)
+{
+	bool first = t.nu_max==0;
+	double p_null = t.p_null;
+	t.g_max = g_max;
+	t.nu_max = t.nu[e_elastic.Above(0.5*t.mass*g_max*g_max/QE)];
+	t.p_null = 1-exp(-t.nu_max*DT*species->subcycle);
+	if(first) printf("MCC: %s nu_max=%.3g /s, p_null=%.3g\n", species->name.c_str(), t.nu_max, t.p_null);
+	if(t.p_null>0.1 && !(p_null>0.1))
+		printf("Warning: MCC p_null of %s is above 0.1, reduce dt (or subcycle) for accurate collisions\n", 
+			species->name.c_str());
+}
+
+void MonteCarloCollisions::Collide(Species *species, int s)
+{
+	Target &t = targets[s];
+	if(t.kind==NONE) return;
+	ParticleArray &part = species->part_list;
+	int np = part.size();
+	
+	/*relative speed of the fastest particle, with neutrals up to 6 thermal 
+	speeds against it; raise nu_max when it outgrows the one covered*/
+	double v_max = 0;
+	#pragma omp parallel for reduction(max:v_max)
+	for(int p=0; p<np; p++)
+		v_max = max(v_max, (double)fabs(part.vel[p]));
+	double g_max = v_max + ((t.kind==ION)?6*vth_neutral:0);
+	if(g_max>t.g_max) SetNuMax(t, g_max, species);
+	if(t.p_null<=0) return;
+	
+	double log_q = log(1-t.p_null);
+	double m = t.mass, M = neutral_mass;
+	long candidates = 0, elastic = 0, cx = 0;
+	
+	#pragma omp parallel reduction(+:candidates,elastic,cx)
+	{
+		RandomStream &rng = rng_streams[omp_get_thread_num()];
+		int start, end;
+		ThreadRange(np, &start, &end);
+		
+		// skipping a geometric number of particles makes each one a 
+		// candidate with probability p_null
+		for(long p=start+(long)(log(1-rng.Uniform())/log_q); p<end; p+=1+(long)(log(1-rng.Uniform())/log_q))
+		{
+			double v = part.vel[p];
+			double vn = (t.kind==ION)?vth_neutral*rng.Normal():0;
+			double g = v-vn;
+			double speed = fabs(g);
+			double energy = 0.5*m*g*g/QE;
+			double R = rng.Uniform()*t.nu_max;
+			candidates++;
+			
+			double sigma_el = (t.kind==ELECTRON)?e_elastic.Lookup(energy):i_elastic.Lookup(energy);
+			double nu = NEUTRAL_DEN*sigma_el*speed;
+			if(R<nu)
+			{
+				// backward in the centre of mass frame half of the time
+				if(rng.Uniform()<0.5) part.vel[p] = v - 2*M/(m+M)*g;
+				elastic++;
+			}
+			else if(t.kind==ION && R<nu+NEUTRAL_DEN*i_cx.Lookup(energy)*speed)
+			{
+				// the ion takes the velocity of the neutral
+				part.vel[p] = vn;
+				cx++;
+			}
+		}
+	}
+	t.candidates += candidates;
+	t.elastic += elastic;
+	t.cx += cx;
+}
+
+void MonteCarloCollisions::Report(vector<Species> &species_list)
+{
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		if(targets[s].kind==NONE) continue;
+		double counts[3] = {(double)targets[s].elastic, (double)targets[s].cx, (double)targets[s].candidates};
+		decomp.Sum(counts, 3);
+		printf("MCC: %s %.0f elastic", species_list[s].name.c_str(), counts[0]);
+		if(targets[s].kind==ION) printf(", %.0f charge exchange", counts[1]);
+		printf(" collisions, %.3g of %.0f candidates\n", counts[2]>0?(counts[0]+counts[1])/counts[2]:0, counts[2]);
+	}
+}
+
+/* Sum the species moments into the ion (positive) and electron (negative) 
+density and velocity fields of the domain*/
+void SumSpeciesMoments(vector<Species> &species_list)
+{
+	memset(domain.ndi,0,sizeof(double)*domain.ni);
+	memset(domain.nde,0,sizeof(double)*domain.ni);
+	memset(domain.veli,0,sizeof(double)*domain.ni);
+	memset(domain.vele,0,sizeof(double)*domain.ni);
+	
+	for(auto &sp:species_list)
+	{
+		double *nd = (sp.charge>0)?domain.ndi:domain.nde;
+		double *vel = (sp.charge>0)?domain.veli:domain.vele;
+		for(int i=0; i<domain.ni; i++)
+		{
+			nd[i] += sp.den[i];
+			vel[i] += sp.vel[i];
+		}
+	}
+}
+
+/* Compute the charge densities */
+void ComputeRho(vector<Species> &species_list)
+{
+	double *rho = domain.rho;
+	memset(rho,0,sizeof(double)*domain.ni);
+	
+	for(auto &sp:species_list)
+		for(int i=0; i<domain.ni; i++)
+			rho[i] += sp.charge*sp.den[i];
+	
+	/*Reduce numerical noise by setting the densities to zero when less than 1e8/m^3*/
+	if(false){
+	for(int i=0; i<domain.ni; i++)
+		if(fabs(rho[i])<1e8*QE) rho[i]=0;
+	}
+}
+
+/* Potential Solver: 1. Gauss-Seidel 2. Direct-Solver*/
+bool SolvePotential(double *phi, double *rho)
+{
+	return field_solver.SolveGS(phi, rho);
+}
+
+/* Potential Direct Solver */
+bool SolvePotentialDirect(double *x, double *rho)
+{
+	return field_solver.SolveDirect(x, rho);
+}
+
+/*Bohm flux of the plasma density into both walls, with the ion mass of the 
+first positive species*/
+void BoltzmannElectrons::Init(vector<Species> &species_list)
+{
+	te = ELECTRON_TEMP;
+	double mass = 40*AMU;
+	for(auto &sp:species_list)
+		if(sp.charge>0) {mass = sp.mass; break;}
+	ion_flux = 2*exp(-0.5)*PLASMA_DEN*sqrt(QE*te/mass);
+	n0 = 0;
+}
+
+bool BoltzmannElectrons::Solve(FieldSolver &solver, double *phi, double *rho)
+{
+	int ni = domain.ni;
+	
+	/*ion flux into the walls from the moments of the last ion scatter*/
+	double flux = max(0.0, domain.veli[ni-1]-domain.veli[0]);
+	ion_flux += (flux-ion_flux)/BOLTZMANN_RELAX;
+	
+	/*half Maxwellian electron flux to the Dirichlet walls at their potential*/
+	double wall = 0;
+	FieldSolver::Side sides[] = {FieldSolver::LEFT, FieldSolver::RIGHT};
+	for(auto side:sides)
+		if(solver.GetBCType(side)==FieldSolver::DIRICHLET)
+			wall += exp(solver.GetBCValue(side)/te);
+	n0 = ion_flux/(wall*sqrt(QE*te/(2*pi*ME)));
+	
+	bool ok = solver.SolveBoltzmann(phi, rho, n0, te);
+	for(int i=0; i<ni; i++)
+	{
+		domain.nde[i] = n0*exp(phi[i]/te);
+		rho[i] -= QE*domain.nde[i];
+	}
+	return ok;
+}
+
+bool FieldSolver::MethodFromName(const string &name, Method *method)
+{
+	if(name=="direct") *method = DIRECT;
+	else if(name=="gs") *method = GS;
+	else if(name=="multigrid") *method = MULTIGRID;
+	else if(name=="pcr") *method = PCR;
+	else return false;
+	return true;
+}
+
+void FieldSolver::Init(int ni, double dx)
+{
+	this->ni = ni;
+	this->dx = dx;
+	a = arena.Take<double>(ni);
+	b = arena.Take<double>(ni);
+	c = arena.Take<double>(ni);
+	inv_b = arena.Take<double>(ni);
+	h.clear();
+	w = arena.Take<double>(ni);
+	for(int i=0; i<ni; i++) w[i] = dx*dx;
+	for(auto &v:newton) v = arena.Take<double>(ni);
+	for(auto &v:pcr) v = arena.Take<double>(ni);
+	bc_type[LEFT] = bc_type[RIGHT] = DIRICHLET;
+	bc_value[LEFT] = bc_value[RIGHT] = 0;
+	
+	levels.clear();
+	int n = ni;
+	do
+	{
+		Level lev;
+		lev.n = n;
+		lev.a = arena.Take<double>(n); lev.b = arena.Take<double>(n); lev.c = arena.Take<double>(n);
+		lev.u = arena.Take<double>(n); lev.g = arena.Take<double>(n); lev.r = arena.Take<double>(n);
+		levels.push_back(lev);
+	} while(Coarsen(n));
+	
+	Factor();
+}
+
+size_t FieldSolver::ArenaBytes(int ni)
+{
+	size_t bytes = 17*Arena::Bytes<double>(ni);
+	int n = ni;
+	do bytes += 6*Arena::Bytes<double>(n); while(Coarsen(n));
+	return bytes;
+}
+
+void FieldSolver::SetBC(Side side, BCType type, double value)
+{
+	bc_value[side] = value;
+	if(bc_type[side] == type) return;
+	bc_type[side] = type;
+	Factor();
+}
+
+/*Flux form of the Poisson equation on the nodes x of a stretched mesh, 
+scaled by dx so the rows of a uniform mesh stay 1,-2,1: the fluxes through 
+the cell faces balance the charge of the node volume*/
+void FieldSolver::SetMesh(const double *x)
+{
+	h.resize(ni-1);
+	for(int i=0; i<ni-1; i++)
+		h[i] = x[i+1]-x[i];
+	for(int i=1; i<ni-1; i++)
+		w[i] = dx*0.5*(h[i-1]+h[i]);
+	w[0] = dx*h[0];
+	w[ni-1] = dx*h[ni-2];
+	Factor();
+}
+
+/*Tridiagonal coefficients on n nodes*/
+void FieldSolver::Coefficients(int n, double *a, double *b, double *c)
+{
+	/*Centtral difference on internal nodes*/
+	bool stretched = !h.empty() && n==ni;
+	if(!stretched)
+	{
+		for(int i=1; i<n-1; i++)
+		{
+			a[i] = 1; b[i] = -2; c[i] = 1;
+		}
+	}
+	else
+	{
+		for(int i=1; i<n-1; i++)
+		{
+			a[i] = dx/h[i-1]; c[i] = dx/h[i]; b[i] = -(a[i]+c[i]);
+		}
+	}
+	double c0 = stretched?2*dx/h[0]:2;
+	double an = stretched?2*dx/h[n-2]:2;
+	
+	/*Dirichlet boundaries fix the potential, Neumann boundaries use a ghost 
+	node mirrored about the wall*/
+	if(bc_type[LEFT] == DIRICHLET) {a[0]=0; b[0]=1; c[0]=0;}
+	else {a[0]=0; b[0]=-c0; c[0]=c0;}
+	
+	if(bc_type[RIGHT] == DIRICHLET) {a[n-1]=0; b[n-1]=1; c[n-1]=0;}
+	else {a[n-1]=an; b[n-1]=-an; c[n-1]=0;}
+}
+
+/*Build the coefficients and store the modified c[] and pivots*/
+void FieldSolver::Factor()
+{
+	Coefficients(ni, a, b, c);
+	
+	/*The multigrid levels share the stencil*/
+	for(auto &lev:levels)
+		Coefficients(lev.n, lev.a, lev.b, lev.c);
+	
+	singular = (bc_type[LEFT] == NEUMANN && bc_type[RIGHT] == NEUMANN);
+	if(singular) return;
+	
+	/*Modify the coefficients*/
+	inv_b[0] = 1/b[0];
+	c[0] *= inv_b[0];
+	for(int i=1; i<ni; i++)
+	{
+		inv_b[i] = 1/(b[i]-c[i-1]*a[i]);
+		c[i] *= inv_b[i];
+	}
+}
+
+/*Right hand side of the tridiagonal system, with the boundary values*/
+void FieldSolver::RightHandSide(double *x, double *rho)
+{
+	/*multiply R.H.S.*/
+	for (int i=1; i<ni-1; i++)
+		x[i]=-rho[i]*w[i]/EPS;
+	
+	if(bc_type[LEFT] == DIRICHLET) x[0] = bc_value[LEFT];
+	else x[0] = -rho[0]*w[0]/EPS + 2*dx*bc_value[LEFT];
+	
+	if(bc_type[RIGHT] == DIRICHLET) x[ni-1] = bc_value[RIGHT];
+	else x[ni-1] = -rho[ni-1]*w[ni-1]/EPS - 2*dx*bc_value[RIGHT];
+}
+
+bool FieldSolver::Undetermined()
+{
+	if(singular)
+		printf("Field solver: Neumann conditions on both walls leave the potential undetermined\n");
+	return singular;
+}
+
+bool FieldSolver::Solve(double *phi, double *rho)
+{
+	switch(method)
+	{
+		case GS: return SolveGS(phi, rho);
+		case MULTIGRID: return SolveMultigrid(phi, rho);
+		case PCR: return SolvePCR(phi, rho);
+		default: return SolveDirect(phi, rho);
+	}
+}
+
+bool FieldSolver::SolveDirect(double *x, double *rho)
+{
+	if(Undetermined()) return false;
+	
+	RightHandSide(x, rho);
+	
+	/*Forward substitution*/
+	x[0] *= inv_b[0];
+	for(int i=1; i<ni; i++)
+		x[i] = (x[i]-x[i-1]*a[i])*inv_b[i];
+	
+	/* Now back substitute */
+	for(int i=ni-2; i>=0; i--)
+		x[i] = x[i] - c[i]*x[i+1];
+	
+	iterations = 1;
+	return true;
+}
+
+/*Successive over-relaxation, starting from the given phi*/
+bool FieldSolver::SolveGS(double *phi, double *rho)
+{
+	if(Undetermined()) return false;
+	
+	double L2 = 0;
+	double dx2 = dx*dx;
+	
+	// Initialize boundaries
+	if(bc_type[LEFT] == DIRICHLET) phi[0] = bc_value[LEFT];
+	if(bc_type[RIGHT] == DIRICHLET) phi[ni-1] = bc_value[RIGHT];
+	
+	// Main Solver
+	for(int it=0; it<200000; it++)
+	{
+		if(bc_type[LEFT] == NEUMANN)
+		{
+			double g = phi[1] + 0.5*dx2*rho[0]/EPS - dx*bc_value[LEFT];
+			phi[0]=phi[0] + 1.4*(g-phi[0]);
+		}
+		for(int i=1; i<ni-1; i++)
+		{
+			double g = 0.5*(phi[i-1] + phi[i+1] + dx2*rho[i]/EPS);
+			phi[i]=phi[i] + 1.4*(g-phi[i]);
+		}
+		if(bc_type[RIGHT] == NEUMANN)
+		{
+			double g = phi[ni-2] + 0.5*dx2*rho[ni-1]/EPS + dx*bc_value[RIGHT];
+			phi[ni-1]=phi[ni-1] + 1.4*(g-phi[ni-1]);
+		}
+		
+		// Check for convergence
+		if(it%25==0)
+		{
+			double sum = 0;
+			for(int i=1; i<ni-1; i++)
+			{
+				double R = -rho[i]/EPS - (phi[i-1]-2*phi[i]+phi[i+1])/dx2;
+				sum += R*R;
+			}
+			L2 = sqrt(sum)/ni;
+			if(L2<1e-4) {iterations = it+1; return true;}
+		}
+	}
+	iterations = 200000;
+	printf("Gauss-Siedel solver failed to converge, L2=%g\n",L2);
+	return false;
+}
+
+/*Red-black Gauss-Seidel sweeps, the two colours are updated in parallel*/
+void FieldSolver::Smooth(Level &lev, double *u, int sweeps)
+{
+	int n = lev.n;
+	const double *a = lev.a, *b = lev.b, *c = lev.c, *g = lev.g;
+	for(int s=0; s<sweeps; s++)
+		for(int colour=0; colour<2; colour++)
+		{
+			#pragma omp parallel for if(n>10000)
+			for(int i=colour; i<n; i+=2)
+			{
+				double sum = g[i];
+				if(i>0) sum -= a[i]*u[i-1];
+				if(i<n-1) sum -= c[i]*u[i+1];
+				u[i] = sum/b[i];
+			}
+		}
+}
+
+/*Residual r = g - Au into lev.r*/
+void FieldSolver::Residual(Level &lev, double *u)
+{
+	int n = lev.n;
+	const double *a = lev.a, *b = lev.b, *c = lev.c, *g = lev.g;
+	double *r = lev.r;
+	#pragma omp parallel for if(n>10000)
+	for(int i=0; i<n; i++)
+	{
+		double R = g[i] - b[i]*u[i];
+		if(i>0) R -= a[i]*u[i-1];
+		if(i<n-1) R -= c[i]*u[i+1];
+		r[i] = R;
+	}
+}
+
+/*V-cycle on level l for the correction u, with the right hand side in levels[l].g*/
+void FieldSolver::Cycle(int l, double *u)
+{
+	Level &lev = levels[l];
+	int n = lev.n;
+	
+	/*Coarsest level: Thomas algorithm, with lev.r as the modified c[]*/
+	if(l == (int)levels.size()-1)
+	{
+		double *cp = lev.r;
+		double inv_b = 1/lev.b[0];
+		cp[0] = lev.c[0]*inv_b;
+		u[0] = lev.g[0]*inv_b;
+		for(int i=1; i<n; i++)
+		{
+			inv_b = 1/(lev.b[i]-cp[i-1]*lev.a[i]);
+			cp[i] = lev.c[i]*inv_b;
+			u[i] = (lev.g[i]-u[i-1]*lev.a[i])*inv_b;
+		}
+		for(int i=n-2; i>=0; i--)
+			u[i] -= cp[i]*u[i+1];
+		return;
+	}
+	
+	Smooth(lev, u, MG_SWEEPS);
+	Residual(lev, u);
+	
+	/*Full weighting restriction of the residual, Neumann walls mirror the 
+	residual and Dirichlet walls have no correction. The factor 4 rescales 
+	to the coarse h^2*/
+	Level &coarse = levels[l+1];
+	int nc = coarse.n;
+	const double *r = lev.r;
+	#pragma omp parallel for if(nc>10000)
+	for(int j=1; j<nc-1; j++)
+		coarse.g[j] = r[2*j-1] + 2*r[2*j] + r[2*j+1];
+	coarse.g[0] = (bc_type[LEFT] == DIRICHLET)?0:2*(r[0]+r[1]);
+	coarse.g[nc-1] = (bc_type[RIGHT] == DIRICHLET)?0:2*(r[n-1]+r[n-2]);
+	
+	/*Solve for the coarse correction from zero and interpolate it back*/
+	double *e = coarse.u;
+	memset(e,0,sizeof(double)*nc);
+	Cycle(l+1, e);
+	#pragma omp parallel for if(nc>10000)
+	for(int j=0; j<nc-1; j++)
+	{
+		u[2*j] += e[j];
+		u[2*j+1] += 0.5*(e[j]+e[j+1]);
+	}
+	u[n-1] += e[nc-1];
+	
+	Smooth(lev, u, MG_SWEEPS);
+}
+
+/*Geometric multigrid V-cycles, starting from the given phi*/
+bool FieldSolver::SolveMultigrid(double *phi, double *rho)
+{
+	if(Undetermined()) return false;
+	
+	Level &fine = levels[0];
+	RightHandSide(fine.g, rho);
+	if(bc_type[LEFT] == DIRICHLET) phi[0] = bc_value[LEFT];
+	if(bc_type[RIGHT] == DIRICHLET) phi[ni-1] = bc_value[RIGHT];
+	
+	/*The residual stalls at a roundoff level growing like ni^2, so the cycles 
+	stop on the change of phi instead, kept in the unused fine level u*/
+	double *prev = fine.u;
+	double change = 0;
+	for(iterations=1; iterations<=MG_MAX_CYCLES; iterations++)
+	{
+		memcpy(prev, phi, sizeof(double)*ni);
+		Cycle(0, phi);
+		double dmax = 0, pmax = 0;
+		#pragma omp parallel for reduction(max:dmax,pmax) if(ni>10000)
+		for(int i=0; i<ni; i++)
+		{
+			dmax = std::max(dmax, fabs(phi[i]-prev[i]));
+			pmax = std::max(pmax, fabs(phi[i]));
+		}
+		change = (pmax>0)?dmax/pmax:0;
+		if(change<=MG_TOL) return true;
+	}
+	iterations--;
+	printf("Multigrid solver failed to converge, relative change=%g\n", change);
+	return false;
+}
+
+/*Parallel cyclic reduction: each sweep eliminates the couplings of every 
+equation to its neighbours at distance s, doubling s, until all equations are 
+decoupled. Equivalent to the direct solve but with every sweep parallel over 
+the nodes, for very large grids*/
+bool FieldSolver::SolvePCR(double *x, double *rho)
+{
+	if(Undetermined()) return false;
+	
+	double *a0 = pcr[0], *b0 = pcr[1], *c0 = pcr[2], *d0 = pcr[3];
+	double *a1 = pcr[4], *b1 = pcr[5], *c1 = pcr[6], *d1 = pcr[7];
+	Coefficients(ni, a0, b0, c0);
+	RightHandSide(d0, rho);
+	
+	iterations = 0;
+	for(int s=1; s<ni; s*=2)
+	{
+		#pragma omp parallel for
+		for(int i=0; i<ni; i++)
+		{
+			double alpha = (i-s>=0)?-a0[i]/b0[i-s]:0;
+			double gamma = (i+s<ni)?-c0[i]/b0[i+s]:0;
+			b1[i] = b0[i];
+			d1[i] = d0[i];
+			a1[i] = c1[i] = 0;
+			if(i-s>=0)
+			{
+				a1[i] = alpha*a0[i-s];
+				b1[i] += alpha*c0[i-s];
+				d1[i] += alpha*d0[i-s];
+			}
+			if(i+s<ni)
+			{
+				c1[i] = gamma*c0[i+s];
+				b1[i] += gamma*a0[i+s];
+				d1[i] += gamma*d0[i+s];
+			}
+		}
+		std::swap(a0,a1); std::swap(b0,b1); std::swap(c0,c1); std::swap(d0,d1);
+		iterations++;
+	}
+	
+	#pragma omp parallel for
+	for(int i=0; i<ni; i++)
+		x[i] = d0[i]/b0[i];
+	return true;
+}
+
+bool FieldSolver::SolveBatch(double *x, double *rho, int nm)
+{
+	if(Undetermined()) return false;
+	
+	/*right hand side as RightHandSide, for each member*/
+	double dx2 = dx*dx;
+	for(int i=1; i<ni-1; i++)
+	{
+		double *xi = x+(size_t)i*nm, *rhoi = rho+(size_t)i*nm;
+		#pragma omp simd
+		for(int m=0; m<nm; m++)
+			xi[m] = -rhoi[m]*dx2/EPS;
+	}
+	double *x_last = x+(size_t)(ni-1)*nm, *rho_last = rho+(size_t)(ni-1)*nm;
+	for(int m=0; m<nm; m++)
+	{
+		if(bc_type[LEFT] == DIRICHLET) x[m] = bc_value[LEFT];
+		else x[m] = -rho[m]*dx2/EPS + 2*dx*bc_value[LEFT];
+		
+		if(bc_type[RIGHT] == DIRICHLET) x_last[m] = bc_value[RIGHT];
+		else x_last[m] = -rho_last[m]*dx2/EPS - 2*dx*bc_value[RIGHT];
+	}
+	
+	/*Forward substitution*/
+	for(int m=0; m<nm; m++)
+		x[m] *= inv_b[0];
+	for(int i=1; i<ni; i++)
+	{
+		double *xi = x+(size_t)i*nm, *xp = xi-nm;
+		#pragma omp simd
+		for(int m=0; m<nm; m++)
+			xi[m] = (xi[m]-xp[m]*a[i])*inv_b[i];
+	}
+	
+	/* Now back substitute */
+	for(int i=ni-2; i>=0; i--)
+	{
+		double *xi = x+(size_t)i*nm, *xn = xi+nm;
+		#pragma omp simd
+		for(int m=0; m<nm; m++)
+			xi[m] = xi[m] - c[i]*xn[m];
+	}
+	
+	iterations = 1;
+	return true;
+}
+
+/*Newton iterations on F(phi) = A phi - g(phi), g the right hand side of 
+rho less the electron charge; the electron density only adds to the diagonal 
+of the Jacobian, so each iteration is one Thomas solve. The steps are capped 
+at te so a poor start can not overflow the exponential*/
+bool FieldSolver::SolveBoltzmann(double *phi, double *rho, double n0, double te)
+{
+	/*the electrons fix the potential level between Neumann walls too*/
+	if(n0<=0 && Undetermined()) return false;
+	
+	double *ja = newton[0], *jb = newton[1], *jc = newton[2];
+	double *f = newton[3];
+	
+	for(iterations=1; iterations<=NEWTON_MAX_ITER; iterations++)
+	{
+		/*residual and Jacobian, the Dirichlet rows stay linear*/
+		Coefficients(ni, ja, jb, jc);
+		RightHandSide(f, rho);
+		for(int i=0; i<ni; i++)
+		{
+			double ne = 0;
+			if(!((i==0 && bc_type[LEFT]==DIRICHLET) || (i==ni-1 && bc_type[RIGHT]==DIRICHLET)))
+				ne = QE*n0*exp(phi[i]/te)*w[i]/EPS;
+			double r = jb[i]*phi[i] - f[i] - ne;
+			if(i>0) r += ja[i]*phi[i-1];
+			if(i<ni-1) r += jc[i]*phi[i+1];
+			f[i] = -r;
+			jb[i] -= ne/te;
+		}
+		
+		/*Thomas solve of J d = -F, d in f*/
+		jc[0] /= jb[0];
+		f[0] /= jb[0];
+		for(int i=1; i<ni; i++)
+		{
+			double inv = 1/(jb[i]-jc[i-1]*ja[i]);
+			jc[i] *= inv;
+			f[i] = (f[i]-f[i-1]*ja[i])*inv;
+		}
+		for(int i=ni-2; i>=0; i--)
+			f[i] -= jc[i]*f[i+1];
+		
+		double change = 0;
+		for(int i=0; i<ni; i++)
+		{
+			double d = max(-te, min(te, f[i]));
+			phi[i] += d;
+			change = max(change, fabs(d));
+		}
+		if(change<NEWTON_TOL*te) break;
+	}
+	
+	if(iterations>NEWTON_MAX_ITER)
+	{
+		iterations = NEWTON_MAX_ITER;
+		return false;
+	}
+	return true;
+}
+
+/*Compute electric field (differentiating potential)*/
+void ComputeEF(double *phi, double *ef)
+{
+	if(!domain.uniform)
+	{
+		vector<double> &x = domain.xn;
+		for(int i=1; i<domain.ni-1; i++)
+			ef[i] = -(phi[i+1]-phi[i-1])/(x[i+1]-x[i-1]);
+		ef[0] = -(phi[1]-phi[0])*domain.inv_h[0];
+		ef[domain.ni-1] = -(phi[domain.ni-1]-phi[domain.ni-2])*domain.inv_h[domain.ni-2];
+		return;
+	}
+	
+	/*Apply central difference to the inner nodes*/
+	for(int i=1; i<domain.ni-1; i++)
+		ef[i] = -(phi[i+1]-phi[i-1])/(2*domain.dx);
+	
+	/*Apply one sided difference at the boundary nodes*/
+	ef[0] = -(phi[1]-phi[0])/domain.dx;
+	ef[domain.ni-1] = -(phi[domain.ni-1]-phi[domain.ni-2])/domain.dx;
+}
+
+/*Electric field of nm members stored [node][member], as ComputeEF*/
+void ComputeEFBatch(double *phi, double *ef, int nm)
+{
+	int ni = domain.ni;
+	for(int i=1; i<ni-1; i++)
+	{
+		double *efi = ef+(size_t)i*nm, *phip = phi+(size_t)(i+1)*nm, *phim = phi+(size_t)(i-1)*nm;
+		#pragma omp simd
+		for(int m=0; m<nm; m++)
+			efi[m] = -(phip[m]-phim[m])/(2*domain.dx);
+	}
+	
+	double *ef_last = ef+(size_t)(ni-1)*nm, *phi_last = phi+(size_t)(ni-1)*nm;
+	for(int m=0; m<nm; m++)
+	{
+		ef[m] = -(phi[nm+m]-phi[m])/domain.dx;
+		ef_last[m] = -(phi_last[m]-phi_last[m-nm])/domain.dx;
+	}
+}
+
+
+void Decomposition::Init(int *argc, char ***argv)
+{
+#ifdef PICS_MPI
+	int provided;
+	MPI_Init_thread(argc, argv, MPI_THREAD_FUNNELED, &provided);
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	if(rank>0 && freopen("/dev/null", "w", stdout)==NULL)
+		fprintf(stderr, "Rank %i: unable to discard the standard output\n", rank);
+#else
+	(void)argc; (void)argv;
+#endif
+}
+
+void Decomposition::Finalize()
+{
+#ifdef PICS_MPI
+	MPI_Finalize();
+#endif
+}
+
+void Decomposition::Split(int nc, double dx)
+{
+	this->nc = nc;
+	this->dx = dx;
+	if(size>1 && nc<(GHOSTS+1)*size)
+	{
+		printf("%i cells are too few for %i ranks, each needs at least %i\n", nc, size, GHOSTS+1);
+		exit(-1);
+	}
+	c0 = (int)((long)nc*rank/size);
+	c1 = (int)((long)nc*(rank+1)/size);
+	left = rank>0?rank-1:-1;
+	right = rank<size-1?rank+1:-1;
+	lo = left<0?0:c0-GHOSTS;
+	hi = right<0?nc:c1+GHOSTS;
+	own_x0 = c0*dx;
+	own_x1 = c1*dx;
+	
+	/*owned nodes [c0,c1) of each rank, the last one with the right wall node*/
+	ends.assign(5*size, 0);
+	counts.resize(size);
+	offsets.resize(size);
+	for(int r=0; r<size; r++)
+	{
+		offsets[r] = (int)((long)nc*r/size);
+		counts[r] = (int)((long)nc*(r+1)/size) - offsets[r] + (r==size-1?1:0);
+	}
+}
+
+void Decomposition::InitSegment()
+{
+	if(size==1) return;
+	segment.Init(c1-c0+1, dx);
+	for(auto &v:reduced) v = arena.Take<double>(size+1);
+}
+
+size_t Decomposition::ArenaBytes()
+{
+	if(size==1) return 0;
+	return FieldSolver::ArenaBytes(c1-c0+1) + 4*Arena::Bytes<double>(size+1);
+}
+
+int Decomposition::Share(int num, double &xmin, double &width)
+{
+	if(size==1) return num;
+	
+	/*the shares of the ranks add up to num, as the fractions at the rank 
+	boundaries are computed alike on both sides*/
+	double f0 = min(max((own_x0-xmin)/width, 0.0), 1.0);
+	double f1 = min(max((own_x1-xmin)/width, 0.0), 1.0);
+	double xmax = min(xmin+width, own_x1);
+	xmin = max(xmin, own_x0);
+	width = max(xmax-xmin, 0.0);
+	return (int)floor(num*f1) - (int)floor(num*f0);
+}
+
+string Decomposition::RankFile(const string &name)
+{
+	if(size==1) return name;
+	return name + "." + to_string(rank);
+}
+
+void Decomposition::Sum(double *data, int n)
+{
+#ifdef PICS_MPI
+	if(size>1) MPI_Allreduce(MPI_IN_PLACE, data, n, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+#else
+	(void)data; (void)n;
+#endif
+}
+
+void Decomposition::Max(double *data, int n)
+{
+#ifdef PICS_MPI
+	if(size>1) MPI_Allreduce(MPI_IN_PLACE, data, n, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+#else
+	(void)data; (void)n;
+#endif
+}
+
+void Decomposition::Broadcast(double *data, int n)
+{
+#ifdef PICS_MPI
+	if(size>1) MPI_Bcast(data, n, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#else
+	(void)data; (void)n;
+#endif
+}
+
+#ifdef PICS_MPI
+/*Swap the packed ghost buffers with both neighbours: n_send and n_recv 
+values to and from the left [0] and the right [1]*/
+void Decomposition::Exchange(int n_send[2], int n_recv[2], int tag)
+{
+	MPI_Request requests[4];
+	for(int d=0; d<2; d++)
+	{
+		int nb = d?right:left;
+		requests[2*d] = requests[2*d+1] = MPI_REQUEST_NULL;
+		if(nb<0) continue;
+		ghost_recv[d].resize(n_recv[d]);
+		MPI_Irecv(ghost_recv[d].data(), n_recv[d], MPI_DOUBLE, nb, tag, MPI_COMM_WORLD, &requests[2*d]);
+		MPI_Isend(ghost_send[d].data(), n_send[d], MPI_DOUBLE, nb, tag, MPI_COMM_WORLD, &requests[2*d+1]);
+	}
+	MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+}
+#endif
+
+void Decomposition::SumGhosts(double **fields, int nf)
+{
+#ifdef PICS_MPI
+	if(size==1) return;
+	
+	/*the left ghosts [lo,c0) belong to the left neighbour, the right ghosts 
+	[c1,hi] (c1 included) to the right one. Local indices of the ghosts sent 
+	and of the owned nodes the neighbours' ghosts are added to*/
+	int src[2] = {0, c1-lo}, n_src[2] = {c0-lo, hi-c1+1};
+	int dst[2] = {c0-lo, c1-GHOSTS-lo}, n_dst[2] = {GHOSTS+1, GHOSTS};
+	int n_send[2], n_recv[2];
+	for(int d=0; d<2; d++)
+	{
+		n_send[d] = nf*n_src[d];
+		n_recv[d] = nf*n_dst[d];
+		ghost_send[d].resize(n_send[d]);
+		for(int f=0; f<nf; f++)
+			memcpy(&ghost_send[d][f*n_src[d]], fields[f]+src[d], sizeof(double)*n_src[d]);
+	}
+	Exchange(n_send, n_recv, 1);
+	for(int d=0; d<2; d++)
+	{
+		if((d?right:left)<0) continue;
+		for(int f=0; f<nf; f++)
+			for(int i=0; i<n_dst[d]; i++)
+				fields[f][dst[d]+i] += ghost_recv[d][f*n_dst[d]+i];
+	}
+#else
+	(void)fields; (void)nf;
+#endif
+}
+
+void Decomposition::CopyGhosts(double *field)
+{
+#ifdef PICS_MPI
+	if(size==1) return;
+	
+	/*send the owned nodes next to the ghosts of the neighbours, (c0,c0+GHOSTS] 
+	to the left and [c1-GHOSTS,c1) to the right*/
+	int src[2] = {c0+1-lo, c1-GHOSTS-lo}, dst[2] = {0, c1+1-lo};
+	int n[2] = {GHOSTS, GHOSTS};
+	for(int d=0; d<2; d++)
+		ghost_send[d].assign(field+src[d], field+src[d]+GHOSTS);
+	Exchange(n, n, 2);
+	for(int d=0; d<2; d++)
+		if((d?right:left)>=0)
+			memcpy(field+dst[d], ghost_recv[d].data(), sizeof(double)*GHOSTS);
+#else
+	(void)field;
+#endif
+}
+
+/*Within the segment [c0,c1] of length L, phi = y + ((L-i)phi(c0) + i phi(c1))/L, 
+with y solved for grounded ends. Substituted into the rows of the segment end 
+nodes, the rank boundaries and the walls, this leaves a tridiagonal system for 
+the end potentials, gathered from y next to the ends*/
+bool Decomposition::SolvePotential(double *phi, double *rho, FieldSolver &walls)
+{
+#ifdef PICS_MPI
+	typedef FieldSolver FS;
+	if(walls.GetBCType(FS::LEFT)==FS::NEUMANN && walls.GetBCType(FS::RIGHT)==FS::NEUMANN)
+	{
+		printf("Field solver: Neumann conditions on both walls leave the potential undetermined\n");
+		return false;
+	}
+	
+	int L = c1-c0;
+	double *y = phi+c0-lo;
+	double *rho_seg = rho+c0-lo;
+	double dx2 = dx*dx;
+	segment.SolveDirect(y, rho_seg);
+	
+	/*length, right hand side at c0, y next to both ends, right hand side at c1*/
+	double mine[5] = {(double)L, -rho_seg[0]*dx2/EPS, y[1], y[L-1], -rho_seg[L]*dx2/EPS};
+	MPI_Allgather(mine, 5, MPI_DOUBLE, ends.data(), 5, MPI_DOUBLE, MPI_COMM_WORLD);
+	
+	int P = size;
+	double *a = reduced[0], *b = reduced[1], *c = reduced[2], *u = reduced[3];
+	memset(a, 0, sizeof(double)*(P+1));
+	memset(c, 0, sizeof(double)*(P+1));
+	for(int k=1; k<P; k++)
+	{
+		const double *prev = &ends[5*(k-1)], *next = &ends[5*k];
+		a[k] = 1/prev[0];
+		c[k] = 1/next[0];
+		b[k] = -(a[k]+c[k]);
+		u[k] = next[1] - prev[3] - next[2];
+	}
+	
+	/*Dirichlet walls fix the potential, Neumann walls mirror the first cell*/
+	const double *first = &ends[0], *last = &ends[5*(P-1)];
+	double bc_left = walls.GetBCValue(FS::LEFT), bc_right = walls.GetBCValue(FS::RIGHT);
+	if(walls.GetBCType(FS::LEFT)==FS::DIRICHLET) {b[0] = 1; u[0] = bc_left;}
+	else {b[0] = -2/first[0]; c[0] = 2/first[0]; u[0] = first[1] + 2*dx*bc_left - 2*first[2];}
+	if(walls.GetBCType(FS::RIGHT)==FS::DIRICHLET) {b[P] = 1; u[P] = bc_right;}
+	else {a[P] = 2/last[0]; b[P] = -2/last[0]; u[P] = last[4] - 2*dx*bc_right - 2*last[3];}
+	
+	/*Thomas algorithm on the end potentials*/
+	for(int k=1; k<=P; k++)
+	{
+		double w = a[k]/b[k-1];
+		b[k] -= w*c[k-1];
+		u[k] -= w*u[k-1];
+	}
+	u[P] /= b[P];
+	for(int k=P-1; k>=0; k--)
+		u[k] = (u[k]-c[k]*u[k+1])/b[k];
+	
+	for(int i=0; i<=L; i++)
+		y[i] += ((L-i)*u[rank] + i*u[rank+1])/L;
+	CopyGhosts(phi);
+#else
+	(void)phi; (void)rho; (void)walls;
+#endif
+	return true;
+}
+
+void Decomposition::Gather(const double *field, double *global)
+{
+	if(size==1)
+	{
+		memcpy(global, field, sizeof(double)*(nc+1));
+		return;
+	}
+#ifdef PICS_MPI
+	MPI_Gatherv(field+c0-lo, counts[rank], MPI_DOUBLE, global, counts.data(), offsets.data(), 
+		MPI_DOUBLE, 0, MPI_COMM_WORLD);
+#endif
+}
+
+void Decomposition::SendMigrants(Species *species, int s)
+{
+#ifdef PICS_MPI
+	if(size==1) return;
+	Migration &m = migration[s];
+	ParticleArray &part = species->part_list;
+	int np = part.size();
+	part.flag.resize(np);
+	
+	/*flag 1: to the left, 2: to the right*/
+	#pragma omp parallel for
+	for(int p=0; p<np; p++)
+		part.flag[p] = (part.pos[p]<own_x0)?1:(part.pos[p]>=own_x1)?2:0;
+	m.send[0].clear();
+	m.send[1].clear();
+	for(int p=0; p<np; p++)
+		if(part.flag[p])
+		{
+			vector<double> &buf = m.send[part.flag[p]-1];
+			buf.push_back(part.pos[p]);
+			buf.push_back(part.vel[p]);
+			buf.push_back(part.id[p]);
+		}
+	part.remove_flagged();
+	
+	int tag = 16+2*s;
+	for(int d=0; d<2; d++)
+	{
+		int nb = d?right:left;
+		MPI_Request *req = &m.requests[3*d];
+		req[0] = req[1] = req[2] = MPI_REQUEST_NULL;
+		m.recv_count[d] = 0;
+		if(nb<0) continue;
+		m.send_count[d] = m.send[d].size()/3;
+		MPI_Isend(&m.send_count[d], 1, MPI_INT, nb, tag, MPI_COMM_WORLD, &req[0]);
+		MPI_Isend(m.send[d].data(), 3*m.send_count[d], MPI_DOUBLE, nb, tag+1, MPI_COMM_WORLD, &req[1]);
+		MPI_Irecv(&m.recv_count[d], 1, MPI_INT, nb, tag, MPI_COMM_WORLD, &req[2]);
+	}
+	m.pending = true;
+#else
+	(void)species; (void)s;
+#endif
+}
+
+void Decomposition::ReserveMigrants(vector<Species> &species_list)
+{
+#ifdef PICS_MPI
+	if(size==1) return;
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		Migration &m = migration[s];
+		size_t n = (size_t)species_list[s].part_list.size()*GHOSTS/(c1-c0) + 64;
+		for(int d=0; d<2; d++)
+		{
+			m.send[d].reserve(3*n);
+			m.recv[d].reserve(3*n);
+		}
+	}
+#else
+	(void)species_list;
+#endif
+}
+
+void Decomposition::ReceiveMigrants(vector<Species> &species_list)
+{
+#ifdef PICS_MPI
+	for(auto &entry:migration)
+	{
+		Migration &m = entry.second;
+		if(!m.pending) continue;
+		int s = entry.first;
+		MPI_Request recv[2];
+		for(int d=0; d<2; d++)
+		{
+			int nb = d?right:left;
+			MPI_Wait(&m.requests[3*d+2], MPI_STATUS_IGNORE);
+			m.recv[d].resize(3*m.recv_count[d]);
+			recv[d] = MPI_REQUEST_NULL;
+			if(nb>=0) MPI_Irecv(m.recv[d].data(), 3*m.recv_count[d], MPI_DOUBLE, nb, 16+2*s+1, 
+				MPI_COMM_WORLD, &recv[d]);
+		}
+		MPI_Waitall(2, recv, MPI_STATUSES_IGNORE);
+		
+		ParticleArray &part = species_list[s].part_list;
+		for(int d=0; d<2; d++)
+		{
+			int first = part.size();
+			part.resize(first+m.recv_count[d]);
+			for(int k=0; k<m.recv_count[d]; k++)
+			{
+				const double *in = &m.recv[d][3*k];
+				if(in[0]<own_x0 || in[0]>=own_x1)
+				{
+					fprintf(stderr, "Rank %i: a particle of %s at x=%g moved past the neighbour rank in one push, reduce dt\n", 
+						rank, species_list[s].name.c_str(), in[0]);
+					MPI_Abort(MPI_COMM_WORLD, -1);
+				}
+				part.pos[first+k] = in[0];
+				part.vel[first+k] = in[1];
+				part.id[first+k] = (int)in[2];
+			}
+		}
+		MPI_Waitall(6, m.requests, MPI_STATUSES_IGNORE);
+		m.pending = false;
+	}
+#else
+	(void)species_list;
+#endif
+}
+
+#ifdef PICS_DEVICE
+/*Device of the target regions: the default offload device, or the host when 
+there is none*/
+int DeviceId()
+{
+	return omp_get_num_devices()>0?omp_get_default_device():omp_get_initial_device();
+}
+
+void *DeviceAlloc(size_t bytes)
+{
+	void *ptr = omp_target_alloc(max(bytes,(size_t)64), DeviceId());
+	if(ptr==NULL)
+	{
+		printf("Unable to allocate %zu bytes on the device\n", bytes);
+		exit(-1);
+	}
+	return ptr;
+}
+
+void DeviceCopy(void *dst, const void *src, size_t bytes, bool to_device)
+{
+	if(bytes==0) return;
+	int host = omp_get_initial_device();
+	omp_target_memcpy(dst, const_cast<void*>(src), bytes, 0, 0, to_device?DeviceId():host, 
+		to_device?host:DeviceId());
+}
+
+/*Device push, the interface of the CPU kernels on device arrays*/
+template<int ORDER> void PushKernelDevice(PartReal *pos, PartReal *vel, unsigned char *flag, int np,
+	const double *ef, int ni, double x0, double dx, double xmax, double dt_qm, double dt)
+{
+	const PartReal dt_p = dt;
+	#pragma omp target teams distribute parallel for is_device_ptr(pos,vel,flag,ef)
+	for(int p=0; p<np; p++)
+	{
+		double part_ef = Shape<ORDER>::Gather((pos[p]-x0)/dx,ef,ni);
+		vel[p] += (PartReal)(dt_qm*part_ef);
+		pos[p] += dt_p*vel[p];
+		flag[p] = (pos[p] < x0) | (pos[p] >= xmax);
+	}
+}
+
+PushKernel push_kernels_device[3] = {PushKernelDevice<0>, PushKernelDevice<1>, PushKernelDevice<2>};
+
+/*Device deposit of the density and flux of np particles, normalized as 
+ScatterSpeciesMomentsShape does*/
+template<int ORDER> void DepositKernelDevice(const PartReal *pos, const PartReal *vel, int np, 
+	double spwt, double *den, double *flux, int ni, double x0, double dx)
+{
+	#pragma omp target teams distribute parallel for is_device_ptr(den,flux)
+	for(int i=0; i<ni; i++)
+		den[i] = flux[i] = 0;
+	
+	#pragma omp target teams distribute parallel for is_device_ptr(pos,vel,den,flux)
+	for(int p=0; p<np; p++)
+	{
+		double lc = (pos[p]-x0)/dx;
+		Shape<ORDER>::ScatterAtomic(lc,spwt,den,ni);
+		Shape<ORDER>::ScatterAtomic(lc,spwt*vel[p],flux,ni);
+	}
+	
+	#pragma omp target teams distribute parallel for is_device_ptr(den,flux)
+	for(int i=0; i<ni; i++)
+	{
+		den[i] /= dx;
+		flux[i] /= dx;
+		if(i==0 || i==ni-1)
+		{
+			den[i] *= 2.0;
+			flux[i] *= 2.0;
+		}
+	}
+}
+
+void DeviceBackend::Init(vector<Species> &species_list, FieldSolver &solver)
+{
+	typedef FieldSolver FS;
+	if(solver.GetBCType(FS::LEFT)==FS::NEUMANN && solver.GetBCType(FS::RIGHT)==FS::NEUMANN)
+	{
+		printf("Device: Neumann conditions on both walls leave the potential undetermined\n");
+		exit(-1);
+	}
+	
+	this->species_list = &species_list;
+	int ni = domain.ni;
+	size_t bytes = sizeof(double)*ni;
+	double *host_fields[] = {domain.phi, domain.ef, domain.rho, domain.ndi, domain.nde, domain.veli, domain.vele};
+	for(int f=0; f<7; f++)
+	{
+		fields[f] = (double*)DeviceAlloc(bytes);
+		DeviceCopy(fields[f], host_fields[f], bytes, true);
+	}
+	
+	vector<double> a(ni), b(ni), c(ni);
+	solver.Matrix(a.data(), b.data(), c.data());
+	double *host_matrix[] = {a.data(), b.data(), c.data()};
+	for(int k=0; k<3; k++)
+	{
+		matrix[k] = (double*)DeviceAlloc(bytes);
+		DeviceCopy(matrix[k], host_matrix[k], bytes, true);
+	}
+	for(int k=0; k<8; k++)
+		pcr[k] = (double*)DeviceAlloc(bytes);
+	
+	/*without a source the species only lose particles, the arrays never grow*/
+	species.resize(species_list.size());
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		Species &sp = species_list[s];
+		ParticleArray &part = sp.part_list;
+		DeviceSpecies &ds = species[s];
+		sp.den.resize(ni);
+		sp.vel.resize(ni);
+		sp.ef_sum.resize(ni);
+		ds.np = part.size();
+		ds.pos = (PartReal*)DeviceAlloc(sizeof(PartReal)*ds.np);
+		ds.vel = (PartReal*)DeviceAlloc(sizeof(PartReal)*ds.np);
+		ds.id = (int*)DeviceAlloc(sizeof(int)*ds.np);
+		ds.flag = (unsigned char*)DeviceAlloc(ds.np);
+		ds.list = (int*)DeviceAlloc(sizeof(int)*ds.np);
+		ds.counter = (int*)DeviceAlloc(2*sizeof(int));
+		ds.den = (double*)DeviceAlloc(bytes);
+		ds.flux = (double*)DeviceAlloc(bytes);
+		ds.ef_sum = (double*)DeviceAlloc(bytes);
+		DeviceCopy(ds.pos, part.pos.data(), sizeof(PartReal)*ds.np, true);
+		DeviceCopy(ds.vel, part.vel.data(), sizeof(PartReal)*ds.np, true);
+		DeviceCopy(ds.id, part.id.data(), sizeof(int)*ds.np, true);
+		DeviceCopy(ds.den, sp.den.data(), bytes, true);
+		DeviceCopy(ds.flux, sp.vel.data(), bytes, true);
+		DeviceCopy(ds.ef_sum, sp.ef_sum.data(), bytes, true);
+	}
+	synced = 2;
+	active = true;
+}
+
+void DeviceBackend::Free()
+{
+	int id = DeviceId();
+	for(auto &ds:species)
+	{
+		void *ptrs[] = {ds.pos, ds.vel, ds.id, ds.flag, ds.list, ds.counter, ds.den, ds.flux, ds.ef_sum};
+		for(void *ptr:ptrs)
+			omp_target_free(ptr, id);
+	}
+	species.clear();
+	for(int f=0; f<7; f++)
+		omp_target_free(fields[f], id);
+	for(int k=0; k<3; k++)
+		omp_target_free(matrix[k], id);
+	for(int k=0; k<8; k++)
+		omp_target_free(pcr[k], id);
+	active = false;
+}
+
+void DeviceBackend::ScatterMoments(int s)
+{
+	Species &sp = (*species_list)[s];
+	DeviceSpecies &ds = species[s];
+	SHAPE_DISPATCH(DepositKernelDevice, ds.pos, ds.vel, ds.np, sp.spwt, ds.den, ds.flux, 
+		domain.ni, domain.x0, domain.dx);
+	synced = 0;
+}
+
+void DeviceBackend::SumMoments()
+{
+	int ni = domain.ni;
+	double *ndi = fields[3], *nde = fields[4], *veli = fields[5], *vele = fields[6];
+	#pragma omp target teams distribute parallel for is_device_ptr(ndi,nde,veli,vele)
+	for(int i=0; i<ni; i++)
+		ndi[i] = nde[i] = veli[i] = vele[i] = 0;
+	
+	for(size_t s=0; s<species.size(); s++)
+	{
+		bool ion = (*species_list)[s].charge>0;
+		double *nd = ion?ndi:nde;
+		double *vel = ion?veli:vele;
+		double *den = species[s].den, *flux = species[s].flux;
+		#pragma omp target teams distribute parallel for is_device_ptr(nd,vel,den,flux)
+		for(int i=0; i<ni; i++)
+		{
+			nd[i] += den[i];
+			vel[i] += flux[i];
+		}
+	}
+	synced = 0;
+}
+
+void DeviceBackend::ComputeRho()
+{
+	int ni = domain.ni;
+	double *rho = fields[2];
+	#pragma omp target teams distribute parallel for is_device_ptr(rho)
+	for(int i=0; i<ni; i++)
+		rho[i] = 0;
+	
+	for(size_t s=0; s<species.size(); s++)
+	{
+		double charge = (*species_list)[s].charge;
+		double *den = species[s].den;
+		#pragma omp target teams distribute parallel for is_device_ptr(rho,den)
+		for(int i=0; i<ni; i++)
+			rho[i] += charge*den[i];
+	}
+	synced = 0;
+}
+
+/*Parallel cyclic reduction as FieldSolver::SolvePCR, one target region per 
+sweep; the right hand side is built on the device from rho*/
+void DeviceBackend::SolvePotential(FieldSolver &solver)
+{
+	typedef FieldSolver FS;
+	int ni = domain.ni;
+	double dx = domain.dx;
+	double dx2 = dx*dx;
+	bool neumann_left = solver.GetBCType(FS::LEFT)==FS::NEUMANN;
+	bool neumann_right = solver.GetBCType(FS::RIGHT)==FS::NEUMANN;
+	double bc_left = solver.GetBCValue(FS::LEFT), bc_right = solver.GetBCValue(FS::RIGHT);
+	double *phi = fields[0], *rho = fields[2];
+	double *ma = matrix[0], *mb = matrix[1], *mc = matrix[2];
+	double *a0 = pcr[0], *b0 = pcr[1], *c0 = pcr[2], *d0 = pcr[3];
+	double *a1 = pcr[4], *b1 = pcr[5], *c1 = pcr[6], *d1 = pcr[7];
+	
+	#pragma omp target teams distribute parallel for is_device_ptr(rho,ma,mb,mc,a0,b0,c0,d0)
+	for(int i=0; i<ni; i++)
+	{
+		a0[i] = ma[i]; b0[i] = mb[i]; c0[i] = mc[i];
+		d0[i] = -rho[i]*dx2/EPS;
+		if(i==0) d0[i] = neumann_left?d0[i]+2*dx*bc_left:bc_left;
+		if(i==ni-1) d0[i] = neumann_right?d0[i]-2*dx*bc_right:bc_right;
+	}
+	
+	for(int s=1; s<ni; s*=2)
+	{
+		#pragma omp target teams distribute parallel for is_device_ptr(a0,b0,c0,d0,a1,b1,c1,d1)
+		for(int i=0; i<ni; i++)
+		{
+			double alpha = (i-s>=0)?-a0[i]/b0[i-s]:0;
+			double gamma = (i+s<ni)?-c0[i]/b0[i+s]:0;
+			b1[i] = b0[i];
+			d1[i] = d0[i];
+			a1[i] = c1[i] = 0;
+			if(i-s>=0)
+			{
+				a1[i] = alpha*a0[i-s];
+				b1[i] += alpha*c0[i-s];
+				d1[i] += alpha*d0[i-s];
+			}
+			if(i+s<ni)
+			{
+				c1[i] = gamma*c0[i+s];
+				b1[i] += gamma*a0[i+s];
+				d1[i] += gamma*d0[i+s];
+			}
+		}
+		std::swap(a0,a1); std::swap(b0,b1); std::swap(c0,c1); std::swap(d0,d1);
+	}
+	
+	#pragma omp target teams distribute parallel for is_device_ptr(phi,b0,d0)
+	for(int i=0; i<ni; i++)
+		phi[i] = d0[i]/b0[i];
+	synced = 0;
+}
+
+void DeviceBackend::ComputeEF()
+{
+	int ni = domain.ni;
+	double dx = domain.dx;
+	double *phi = fields[0], *ef = fields[1];
+	#pragma omp target teams distribute parallel for is_device_ptr(phi,ef)
+	for(int i=0; i<ni; i++)
+	{
+		if(i==0) ef[i] = -(phi[1]-phi[0])/dx;
+		else if(i==ni-1) ef[i] = -(phi[ni-1]-phi[ni-2])/dx;
+		else ef[i] = -(phi[i+1]-phi[i-1])/(2*dx);
+	}
+	synced = 0;
+}
+
+int DeviceBackend::Push(int s, int ts)
+{
+	Species &sp = (*species_list)[s];
+	DeviceSpecies &ds = species[s];
+	int ni = domain.ni;
+	double *ef = fields[1];
+	
+	/*subcycled species push at the end of the cycle in the averaged field*/
+	if(sp.subcycle>1)
+	{
+		double *ef_sum = ds.ef_sum;
+		int n = sp.subcycle;
+		bool push = (ts%n==n-1);
+		#pragma omp target teams distribute parallel for is_device_ptr(ef,ef_sum)
+		for(int i=0; i<ni; i++)
+		{
+			ef_sum[i] += ef[i];
+			if(push) ef_sum[i] /= n;
+		}
+		synced = 0;
+		if(!push) return 0;
+		ef = ef_sum;
+	}
+	
+	double qm = sp.charge/sp.mass;
+	double dt = DT*sp.subcycle;
+	int np = ds.np;
+	push_kernels_device[SHAPE_ORDER](ds.pos, ds.vel, ds.flag, np, ef, ni, domain.x0, 
+		domain.dx, domain.xmax, dt*qm, dt);
+	Compact(ds);
+	
+	if(sp.subcycle>1)
+	{
+		double *ef_sum = ds.ef_sum;
+		#pragma omp target teams distribute parallel for is_device_ptr(ef_sum)
+		for(int i=0; i<ni; i++)
+			ef_sum[i] = 0;
+	}
+	synced = 0;
+	return np;
+}
+
+/*Remove the flagged particles in parallel: with k of the np particles flagged, 
+the unflagged ones past np-k move into the flagged slots before it*/
+void DeviceBackend::Compact(DeviceSpecies &ds)
+{
+	int np = ds.np;
+	unsigned char *flag = ds.flag;
+	int k = 0;
+	#pragma omp target teams distribute parallel for reduction(+:k) map(tofrom:k) is_device_ptr(flag)
+	for(int p=0; p<np; p++)
+		k += flag[p];
+	if(k==0) return;
+	
+	int m = np-k;
+	int *list = ds.list, *counter = ds.counter;
+	int zero[2] = {0, 0};
+	DeviceCopy(counter, zero, sizeof(zero), true);
+	
+	/*holes from the front of list, movers from list+k*/
+	#pragma omp target teams distribute parallel for is_device_ptr(flag,list,counter)
+	for(int p=0; p<np; p++)
+	{
+		int j;
+		if(p<m && flag[p])
+		{
+			#pragma omp atomic capture
+			j = counter[0]++;
+			list[j] = p;
+		}
+		else if(p>=m && !flag[p])
+		{
+			#pragma omp atomic capture
+			j = counter[1]++;
+			list[k+j] = p;
+		}
+	}
+	
+	int holes[2];
+	DeviceCopy(holes, counter, sizeof(holes), false);
+	PartReal *pos = ds.pos, *vel = ds.vel;
+	int *id = ds.id;
+	int n = holes[0];
+	#pragma omp target teams distribute parallel for is_device_ptr(pos,vel,id,list)
+	for(int j=0; j<n; j++)
+	{
+		int dst = list[j], src = list[k+j];
+		pos[dst] = pos[src];
+		vel[dst] = vel[src];
+		id[dst] = id[src];
+	}
+	ds.np = m;
+}
+
+void DeviceBackend::Download(bool particles)
+{
+	if(synced==2 || (synced==1 && !particles)) return;
+	int ni = domain.ni;
+	size_t bytes = sizeof(double)*ni;
+	double *host_fields[] = {domain.phi, domain.ef, domain.rho, domain.ndi, domain.nde, domain.veli, domain.vele};
+	for(int f=0; f<7; f++)
+		DeviceCopy(host_fields[f], fields[f], bytes, false);
+	
+	for(size_t s=0; s<species.size(); s++)
+	{
+		Species &sp = (*species_list)[s];
+		DeviceSpecies &ds = species[s];
+		DeviceCopy(sp.den.data(), ds.den, bytes, false);
+		DeviceCopy(sp.vel.data(), ds.flux, bytes, false);
+		DeviceCopy(sp.ef_sum.data(), ds.ef_sum, bytes, false);
+		if(!particles) continue;
+		
+		ParticleArray &part = sp.part_list;
+		part.resize(ds.np);
+		DeviceCopy(part.pos.data(), ds.pos, sizeof(PartReal)*ds.np, false);
+		DeviceCopy(part.vel.data(), ds.vel, sizeof(PartReal)*ds.np, false);
+		DeviceCopy(part.id.data(), ds.id, sizeof(int)*ds.np, false);
+	}
+	synced = particles?2:1;
+}
+#else
+/*Without -DPICS_DEVICE, device=true is refused and the backend stays inactive*/
+void DeviceBackend::Init(vector<Species> &, FieldSolver &) {}
+void DeviceBackend::Free() {}
+void DeviceBackend::ScatterMoments(int) {}
+void DeviceBackend::SumMoments() {}
+void DeviceBackend::ComputeRho() {}
+void DeviceBackend::SolvePotential(FieldSolver &) {}
+void DeviceBackend::ComputeEF() {}
+int DeviceBackend::Push(int, int) {return 0;}
+void DeviceBackend::Compact(DeviceSpecies &) {}
+void DeviceBackend::Download(bool) {}
+#endif
+
+/*Open an output file with a large buffer. Binary files start with a 
+self-describing header:
+	char magic[8], int32 version, int32 ni, int32 nfields, 
+	char names[nfields][16], double x[ni] (only when x is given)
+followed by one record per dump: double time, double data[nfields][ni]*/
+FILE *OpenOutput(const char *name, const char *magic, int ni, int nfields, const char **names, const double *x, bool append)
+{
+	FILE *file = fopen(name,append?(BINARY_OUTPUT?"ab":"a"):(BINARY_OUTPUT?"wb":"w"));
+	if(file==NULL)
+	{
+		printf("Unable to open %s\n", name);
+		exit(-1);
+	}
+	setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER);
+	
+	/*appending to an existing file (restart): the header is already there*/
+	if(append && ftell(file)>0) return file;
+	
+	if(BINARY_OUTPUT)
+	{
+		char magic_buf[8] = {0};
+		strncpy(magic_buf, magic, 7);
+		int header[3] = {1, ni, nfields};
+		fwrite(magic_buf, 1, 8, file);
+		fwrite(header, sizeof(int), 3, file);
+		for(int f=0; f<nfields; f++)
+		{
+			char name_buf[16] = {0};
+			strncpy(name_buf, names[f], 15);
+			fwrite(name_buf, 1, 16, file);
+		}
+		if(x) fwrite(x, sizeof(double), ni, file);
+	}
+	return file;
+}
+
+/*Read the last record of an averages file, text or binary (told apart by 
+the PICSAVG magic), into fields: 12 profiles of ni nodes*/
+bool ReadAverages(const string &name, int ni, vector<double> &fields)
+{
+	const int nfields = 12;
+	fields.assign(nfields*ni, 0);
+	ifstream in(name, ios::binary);
+	if(!in.is_open())
+	{
+		printf("Unable to open %s\n", name.c_str());
+		return false;
+	}
+	
+	char magic[8] = {0};
+	in.read(magic, 8);
+	if(in && strncmp(magic,"PICSAVG",8)==0)
+	{
+		int header[3];
+		in.read((char*)header, sizeof(header));
+		if(!in || header[1]!=ni || header[2]!=nfields)
+		{
+			printf("%s does not match the grid of this run\n", name.c_str());
+			return false;
+		}
+		in.seekg(16*nfields + sizeof(double)*ni, ios::cur);
+		vector<double> record(1+nfields*ni);
+		bool found = false;
+		while(in.read((char*)record.data(), sizeof(double)*record.size()))
+		{
+			std::copy(record.begin()+1, record.end(), fields.begin());
+			found = true;
+		}
+		if(!found) printf("%s holds no averages\n", name.c_str());
+		return found;
+	}
+	
+	/*text: blocks of ni lines of x and the 12 fields, keep the last block*/
+	in.clear();
+	in.seekg(0);
+	vector<double> values;
+	double value;
+	while(in >> value) values.push_back(value);
+	size_t block = (size_t)(1+nfields)*ni;
+	if(values.size()<block || values.size()%block!=0)
+	{
+		printf("%s does not match the grid of this run\n", name.c_str());
+		return false;
+	}
+	size_t first = values.size()-block;
+	for(int i=0; i<ni; i++)
+		for(int f=0; f<nfields; f++)
+			fields[f*ni+i] = values[first+(size_t)i*(1+nfields)+1+f];
+	return true;
+}
+
+/*Validation mode: relative L2 difference of the averaged profiles of this run 
+against a reference run. The densities and the potential must agree within 
+VALIDATE_TOL; the velocity moments and the field are reported only*/
+bool ValidateAverages(const string &name, const string &ref_name, int ni)
+{
+	vector<double> run, ref;
+	if(!ReadAverages(name, ni, run) || !ReadAverages(ref_name, ni, ref)) return false;
+	
+	const char *names[] = {"ndi","nde","veli","vele","phi","ef"};
+	const bool checked[] = {true, true, false, false, true, false};
+	bool ok = true;
+	printf("Validation against %s (precision: %s particles)\n", ref_name.c_str(), 
+		sizeof(PartReal)<sizeof(double)?"single":"double");
+	for(int f=0; f<6; f++)
+	{
+		double diff = 0, norm = 0;
+		for(int i=0; i<ni; i++)
+		{
+			double a = run[2*f*ni+i], b = ref[2*f*ni+i];
+			diff += (a-b)*(a-b);
+			norm += b*b;
+		}
+		double rel = norm>0?sqrt(diff/norm):sqrt(diff);
+		bool pass = !checked[f] || rel<=VALIDATE_TOL;
+		printf("  %-5s relative L2 difference %.3g%s\n", names[f], rel, 
+			checked[f]?(pass?"  ok":"  FAILED"):"");
+		ok &= pass;
+	}
+	printf("Validation %s\n", ok?"passed":"FAILED");
+	return ok;
+}
+
+/*Append the timing breakdown as a JSON line. Interval reports reset the 
+interval counters*/
+void PhaseTimer::Report(FILE *file, int ts, bool whole_run, long bytes)
+{
+	const char *names[NUM_PHASES] = {"scatter","rho","solve","ef","push","sort","collide","io"};
+	double *t = whole_run?total:interval;
+	double sum = 0;
+	
+	fprintf(file,"{\"ts\": %i, \"scope\": \"%s\"", ts, whole_run?"run":"interval");
+	for(int ph=0; ph<NUM_PHASES; ph++)
+	{
+		fprintf(file,", \"%s\": %.6e", names[ph], t[ph]);
+		sum += t[ph];
+	}
+	double pushes = whole_run?pushes_total:pushes_interval;
+	fprintf(file,", \"time\": %.6e, \"pushes\": %.6e, \"pushes_per_s\": %.6e, \"bytes\": %li}\n", 
+		sum, pushes, sum>0?pushes/sum:0, whole_run?bytes:bytes-bytes_mark);
+	fflush(file);
+	
+	if(whole_run) return;
+	for(int ph=0; ph<NUM_PHASES; ph++) interval[ph] = 0;
+	pushes_interval = 0;
+	bytes_mark = bytes;
+}
+
+/*SIGTERM only raises a flag, the main loop checkpoints at the end of the step*/
+void HandleSigterm(int)
+{
+	sigterm_received = 1;
+}
+
+/*Append raw bytes to the checkpoint buffer*/
+void Pack(vector<char> &buf, const void *data, size_t bytes)
+{
+	buf.insert(buf.end(), (const char*)data, (const char*)data+bytes);
+}
+
+/*Read raw bytes from the checkpoint buffer, false when it is too short*/
+bool Unpack(const vector<char> &buf, size_t &offset, void *data, size_t bytes)
+{
+	if(offset+bytes>buf.size()) return false;
+	memcpy(data, &buf[offset], bytes);
+	offset += bytes;
+	return true;
+}
+
+/*Particle data goes to the checkpoint in double whatever the particle 
+precision, so checkpoints carry over between single and double builds*/
+void PackReal(vector<char> &buf, const PartReal *data, int n)
+{
+	size_t offset = buf.size();
+	buf.resize(offset+sizeof(double)*n);
+	for(int p=0; p<n; p++)
+	{
+		double value = data[p];
+		memcpy(&buf[offset+sizeof(double)*p], &value, sizeof(double));
+	}
+}
+
+bool UnpackReal(const vector<char> &buf, size_t &offset, PartReal *data, int n)
+{
+	if(offset+sizeof(double)*n>buf.size()) return false;
+	for(int p=0; p<n; p++)
+	{
+		double value;
+		memcpy(&value, &buf[offset+sizeof(double)*p], sizeof(double));
+		data[p] = value;
+	}
+	offset += sizeof(double)*n;
+	return true;
+}
+
+/*Write the full simulation state to a snapshot, serialized in memory and 
+written with one sequential write to a temporary file that is then renamed, 
+so a crash mid-write never leaves a truncated checkpoint. Layout:
+	char magic[8], int32 version, ni, num_species, num_streams,
+	int32 ts_next, double Time, double ion_flux (Boltzmann electrons), double fields[7][ni],
+	per species: char name[32], int32 np, next_id, double pos[np], vel[np], 
+		int32 id[np], double den[ni], vel_moment[ni], ef_sum[ni],
+	per random stream: int32 length, char state[length]*/
+bool WriteCheckpoint(const string &rank_name, int ts_next, double Time, vector<Species> &species_list)
+{
+	string name = decomp.RankFile(rank_name);
+	vector<char> buf;
+	char magic[8] = "PICSCHK";
+	int header[4] = {4, domain.ni, (int)species_list.size(), (int)rng_streams.size()};
+	Pack(buf, magic, 8);
+	Pack(buf, header, sizeof(header));
+	Pack(buf, &ts_next, sizeof(int));
+	Pack(buf, &Time, sizeof(double));
+	Pack(buf, &boltzmann.ion_flux, sizeof(double));
+	
+	double *fields[] = {domain.phi, domain.ef, domain.rho, domain.nde, domain.ndi, domain.veli, domain.vele};
+	for(int f=0; f<7; f++)
+		Pack(buf, fields[f], sizeof(double)*domain.ni);
+	
+	for(auto &sp:species_list)
+	{
+		ParticleArray &part = sp.part_list;
+		char sp_name[32] = {0};
+		strncpy(sp_name, sp.name.c_str(), 31);
+		int counts[2] = {part.size(), sp.getPartId()};
+		Pack(buf, sp_name, 32);
+		Pack(buf, counts, sizeof(counts));
+		PackReal(buf, part.pos.data(), part.size());
+		PackReal(buf, part.vel.data(), part.size());
+		Pack(buf, part.id.data(), sizeof(int)*part.size());
+		Pack(buf, sp.den.data(), sizeof(double)*domain.ni);
+		Pack(buf, sp.vel.data(), sizeof(double)*domain.ni);
+		Pack(buf, sp.ef_sum.data(), sizeof(double)*domain.ni);
+	}
+	
+	for(auto &stream:rng_streams)
+	{
+		int length = sizeof(RandomStream);
+		Pack(buf, &length, sizeof(int));
+		Pack(buf, &stream, length);
+	}
+	
+	string tmp_name = name + ".tmp";
+	FILE *file = fopen(tmp_name.c_str(),"wb");
+	if(file==NULL || fwrite(buf.data(), 1, buf.size(), file)!=buf.size())
+	{
+		printf("Unable to write checkpoint %s\n", tmp_name.c_str());
+		if(file) fclose(file);
+		return false;
+	}
+	fclose(file);
+	rename(tmp_name.c_str(), name.c_str());
+	return true;
+}
+
+/*Restore the simulation state written by WriteCheckpoint. The grid and the 
+species must match the ones set up from the input deck*/
+bool ReadCheckpoint(const string &rank_name, int &ts_next, double &Time, vector<Species> &species_list)
+{
+	string name = decomp.RankFile(rank_name);
+	ifstream in(name, ios::binary);
+	if(!in.is_open())
+	{
+		printf("Unable to open checkpoint %s\n", name.c_str());
+		return false;
+	}
+	vector<char> buf((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	size_t offset = 0;
+	
+	char magic[8];
+	int header[4];
+	bool ok = Unpack(buf, offset, magic, 8) && Unpack(buf, offset, header, sizeof(header));
+	if(!ok || strncmp(magic,"PICSCHK",8)!=0 || header[0]!=4)
+	{
+		printf("%s is not a version 4 checkpoint file\n", name.c_str());
+		return false;
+	}
+	if(header[1]!=domain.ni || header[2]!=(int)species_list.size())
+	{
+		printf("Checkpoint %s has %i nodes and %i species, the input has %i and %i\n", name.c_str(), 
+			header[1], header[2], domain.ni, (int)species_list.size());
+		return false;
+	}
+	ok = Unpack(buf, offset, &ts_next, sizeof(int)) && Unpack(buf, offset, &Time, sizeof(double)) && 
+		Unpack(buf, offset, &boltzmann.ion_flux, sizeof(double));
+	
+	double *fields[] = {domain.phi, domain.ef, domain.rho, domain.nde, domain.ndi, domain.veli, domain.vele};
+	for(int f=0; f<7 && ok; f++)
+		ok = Unpack(buf, offset, fields[f], sizeof(double)*domain.ni);
+	
+	for(auto &sp:species_list)
+	{
+		ParticleArray &part = sp.part_list;
+		char sp_name[32];
+		int counts[2];
+		ok = ok && Unpack(buf, offset, sp_name, 32) && Unpack(buf, offset, counts, sizeof(counts));
+		if(!ok) break;
+		if(sp.name.compare(0, 31, sp_name)!=0)
+			printf("Warning: checkpoint species %s restored as %s\n", sp_name, sp.name.c_str());
+		part.resize(counts[0]);
+		sp.setPartId(counts[1]);
+		ok = UnpackReal(buf, offset, part.pos.data(), counts[0]) &&
+			UnpackReal(buf, offset, part.vel.data(), counts[0]) &&
+			Unpack(buf, offset, part.id.data(), sizeof(int)*counts[0]) &&
+			Unpack(buf, offset, sp.den.data(), sizeof(double)*domain.ni) &&
+			Unpack(buf, offset, sp.vel.data(), sizeof(double)*domain.ni) &&
+			Unpack(buf, offset, sp.ef_sum.data(), sizeof(double)*domain.ni);
+	}
+	
+	/*restore the random streams; extra threads keep their fresh seeds*/
+	if(header[3]!=(int)rng_streams.size())
+		printf("Warning: checkpoint has %i random streams, running with %i threads\n", 
+			header[3], (int)rng_streams.size());
+	for(int t=0; t<header[3] && ok; t++)
+	{
+		int length;
+		ok = Unpack(buf, offset, &length, sizeof(int)) && length==(int)sizeof(RandomStream) && 
+			offset+length<=buf.size();
+		if(!ok) break;
+		if(t<(int)rng_streams.size())
+			memcpy(&rng_streams[t], &buf[offset], length);
+		offset += length;
+	}
+	
+	if(!ok) printf("Checkpoint %s is truncated\n", name.c_str());
+	return ok;
+}
+
+/*Stage the fields for output with time*/
+void Write_ts(int ts)
+{
+	DiagJob *job = diag_writer.Acquire();
+	double *fields[] = {domain.ndi, domain.nde, domain.rho, domain.veli, domain.vele, domain.phi, domain.ef};
+	int ng = domain.ng;
+	job->type = DiagJob::FIELDS;
+	job->time = ts*DT;
+	job->n = ng;
+	job->Stage(7*ng);
+	for(int f=0; f<7; f++)
+		decomp.Gather(fields[f], &job->data[f*ng]);
+	diag_writer.Submit(job);
+}
+
+/*Stage the averages of the current window: the mean and the standard 
+deviation of each field, with the start of the window as the record time*/
+void WriteAverages(FieldAverage &average)
+{
+	int ni = average.ni, ng = domain.ng;
+	DiagJob *job = diag_writer.Acquire();
+	job->type = DiagJob::AVERAGES;
+	job->time = average.ts_first*DT;
+	job->n = ng;
+	job->Stage(2*average.nf*ng);
+	double *std_dev = average.std_dev;
+	for(int f=0; f<average.nf; f++)
+	{
+		for(int i=0; i<ni; i++)
+			std_dev[i] = average.count>1?sqrt(average.m2[f*ni+i]/(average.count-1)):0;
+		decomp.Gather(&average.mean[f*ni], &job->data[2*f*ng]);
+		decomp.Gather(std_dev, &job->data[(2*f+1)*ng]);
+	}
+	diag_writer.Submit(job);
+}
+
+/*Open phase_space.bin and write its header: species, bins and velocity 
+ranges, the regions, then the bin edges in x; skipped when appending on restart*/
+FILE *OpenPhaseSpace(const char *name, PhaseSpace &phase_space, vector<Species> &species_list, bool append)
+{
+	FILE *file = fopen(name, append?"ab":"wb");
+	if(file==NULL)
+	{
+		printf("Unable to open %s\n", name);
+		exit(-1);
+	}
+	setvbuf(file, NULL, _IOFBF, OUTPUT_BUFFER);
+	if(append && ftell(file)>0) return file;
+	
+	char magic[8] = "PICSPS";
+	int header[5] = {1, (int)species_list.size(), phase_space.nx, phase_space.nv, phase_space.nreg};
+	double x_range[2] = {phase_space.x0, phase_space.x0+phase_space.nx*phase_space.dx_bin};
+	fwrite(magic, 1, 8, file);
+	fwrite(header, sizeof(int), 5, file);
+	fwrite(x_range, sizeof(double), 2, file);
+	fwrite(phase_space.regions.data(), sizeof(double), 2*phase_space.nreg, file);
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		char name_buf[32] = {0};
+		strncpy(name_buf, species_list[s].name.c_str(), 31);
+		double v_range[2] = {phase_space.vmin[s], phase_space.vmin[s]+phase_space.nv*phase_space.dv[s]};
+		fwrite(name_buf, 1, 32, file);
+		fwrite(v_range, sizeof(double), 2, file);
+	}
+	return file;
+}
+
+/*Stage the phase space of all species: real particles per bin, averaged 
+over the samples since the last dump*/
+void WritePhaseSpace(PhaseSpace &phase_space, vector<Species> &species_list, double Time)
+{
+	int size = (phase_space.nx+phase_space.nreg)*phase_space.nv;
+	DiagJob *job = diag_writer.Acquire();
+	job->type = DiagJob::PHASE_SPACE;
+	job->time = Time;
+	job->n = size*species_list.size();
+	job->Stage(job->n);
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		int samples = phase_space.samples[s];
+		double w = samples>0?species_list[s].spwt/samples:0;
+		const double *h = phase_space.hist[s];
+		for(int k=0; k<size; k++)
+			job->data[s*size+k] = w*h[k];
+	}
+	decomp.Sum(job->data, job->n);
+	diag_writer.Submit(job);
+}
+
+/*Raw particle dump (one file per rank when decomposed). The particles of each 
+species are ordered by cell and cut into chunks of particle_chunk particles, 
+so a reader can map one species or one x range from the index without reading 
+the rest. Offsets are in bytes from the start of the file, the chunks start on 
+4096 byte pages so they can be mapped:
+	char magic[8] "PICSPRT", int32 version, int32 nspecies, int32 real_size (4 or 8),
+	int32 ts, double time, int64 nchunks, int64 chunk_particles
+	species[nspecies]: char name[32], double spwt, mass, charge,
+		int64 count, int64 first_chunk, int64 num_chunks
+	chunks[nchunks]: int32 species, int32 count, double xmin, xmax, int64 offset
+	chunk data at offset: real pos[count], real vel[count], int32 id[count]
+The threads gather and write the chunks in parallel, the particles stay in 
+place. The header goes last, so an interrupted dump has no valid magic*/
+bool WriteParticles(const string &rank_name, int ts, double Time, vector<Species> &species_list)
+{
+	const int64_t PAGE = 4096;
+	string name = decomp.RankFile(rank_name);
+	int ns = species_list.size();
+	int real_size = sizeof(PartReal);
+	
+	struct Chunk
+	{
+		int s, count, first;  // species, particles, first of them in the order
+		double xmin, xmax;
+		int64_t offset;
+	};
+	vector<Chunk> chunks;
+	vector<vector<int>> order(ns);
+	vector<int64_t> first_chunk(ns), num_chunks(ns);
+	for(int s=0; s<ns; s++)
+	{
+		ParticleArray &part = species_list[s].part_list;
+		part.order_by_cell(domain.x0, domain.dx, domain.ni-1, order[s]);
+		first_chunk[s] = chunks.size();
+		for(int p=0; p<part.size(); p+=PARTICLE_CHUNK)
+			chunks.push_back({s, min(PARTICLE_CHUNK, part.size()-p), p, 0, 0, 0});
+		num_chunks[s] = (int64_t)chunks.size()-first_chunk[s];
+	}
+	
+	int64_t header_bytes = 48 + 80*(int64_t)ns + 32*(int64_t)chunks.size();
+	int64_t offset = (header_bytes+PAGE-1)/PAGE*PAGE;
+	for(auto &chunk:chunks)
+	{
+		chunk.offset = offset;
+		offset += ((int64_t)chunk.count*(2*real_size+4)+PAGE-1)/PAGE*PAGE;
+	}
+	
+	int fd = open(name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd<0)
+	{
+		printf("Unable to open %s\n", name.c_str());
+		return false;
+	}
+	
+	int failed = 0;
+	#pragma omp parallel reduction(+:failed)
+	{
+		vector<char> buf;
+		#pragma omp for schedule(dynamic)
+		for(size_t c=0; c<chunks.size(); c++)
+		{
+			Chunk &chunk = chunks[c];
+			ParticleArray &part = species_list[chunk.s].part_list;
+			const int *ord = &order[chunk.s][chunk.first];
+			size_t bytes = ((int64_t)chunk.count*(2*real_size+4)+PAGE-1)/PAGE*PAGE;
+			buf.assign(bytes, 0);
+			PartReal *pos = (PartReal*)buf.data();
+			PartReal *vel = pos+chunk.count;
+			int *id = (int*)(vel+chunk.count);
+			double xmin = domain.xmax, xmax = domain.x0;
+			for(int k=0; k<chunk.count; k++)
+			{
+				int p = ord[k];
+				pos[k] = part.pos[p];
+				vel[k] = part.vel[p];
+				id[k] = part.id[p];
+				xmin = min(xmin, (double)pos[k]);
+				xmax = max(xmax, (double)pos[k]);
+			}
+			chunk.xmin = xmin;
+			chunk.xmax = xmax;
+			if(pwrite(fd, buf.data(), bytes, chunk.offset)!=(ssize_t)bytes) failed++;
+		}
+	}
+	
+	vector<char> buf;
+	char magic[8] = "PICSPRT";
+	int header[4] = {1, ns, real_size, ts};
+	int64_t counts[2] = {(int64_t)chunks.size(), PARTICLE_CHUNK};
+	Pack(buf, magic, 8);
+	Pack(buf, header, sizeof(header));
+	Pack(buf, &Time, sizeof(double));
+	Pack(buf, counts, sizeof(counts));
+	for(int s=0; s<ns; s++)
+	{
+		Species &sp = species_list[s];
+		char sp_name[32] = {0};
+		strncpy(sp_name, sp.name.c_str(), 31);
+		double props[3] = {sp.spwt, sp.mass, sp.charge};
+		int64_t index[3] = {sp.part_list.size(), first_chunk[s], num_chunks[s]};
+		Pack(buf, sp_name, 32);
+		Pack(buf, props, sizeof(props));
+		Pack(buf, index, sizeof(index));
+	}
+	for(auto &chunk:chunks)
+	{
+		int ids[2] = {chunk.s, chunk.count};
+		double range[2] = {chunk.xmin, chunk.xmax};
+		Pack(buf, ids, sizeof(ids));
+		Pack(buf, range, sizeof(range));
+		Pack(buf, &chunk.offset, sizeof(int64_t));
+	}
+	if(pwrite(fd, buf.data(), buf.size(), 0)!=(ssize_t)buf.size()) failed++;
+	close(fd);
+	
+	if(failed)
+	{
+		printf("Unable to write %s\n", name.c_str());
+		return false;
+	}
+	bytes_written += offset;
+	return true;
+}
+
+void WriteKE(double Time, vector<Species> &species_list)
+{
+	DiagJob *job = diag_writer.Acquire();
+	job->type = DiagJob::KE;
+	job->time = Time;
+	job->n = species_list.size();
+	job->Stage(species_list.size());
+	for(size_t s=0; s<species_list.size(); s++)
+		job->data[s] = ComputeKE(&species_list[s]);
+	diag_writer.Submit(job);
+}
+
+/* Flush the output files once the staged records are written*/
+void FlushOutput()
+{
+	DiagJob *job = diag_writer.Acquire();
+	job->type = DiagJob::FLUSH;
+	diag_writer.Submit(job);
+}
+
+/*Serialize one staged record (runs on the writer thread)*/
+void WriteJob(DiagJob *job)
+{
+	int n = job->n;
+	double *d = job->data;
+	long bytes = 0;
+	
+	switch(job->type)
+	{
+	case DiagJob::FIELDS:
+		if(BINARY_OUTPUT)
+		{
+			bytes += sizeof(double)*fwrite(&job->time, sizeof(double), 1, file_res);
+			bytes += sizeof(double)*fwrite(d, sizeof(double), 7*n, file_res);
+			break;
+		}
+		for(int i=0; i<n; i++)
+		{
+			bytes += fprintf(file_res,"%g \t %g \t %g \t %g \t %g \t %g \t %g \t %g\n", NodeX(i), d[i],
+		d[n+i], d[2*n+i], d[3*n+i], d[4*n+i], d[5*n+i], d[6*n+i]);
+		}
+		break;
+		
+	case DiagJob::KE:
+		if(BINARY_OUTPUT)
+		{
+			bytes += sizeof(double)*fwrite(&job->time, sizeof(double), 1, file_ke);
+			bytes += sizeof(double)*fwrite(d, sizeof(double), n, file_ke);
+			break;
+		}
+		bytes += fprintf(file_ke,"%g",job->time);
+		for(int s=0; s<n; s++)
+			bytes += fprintf(file_ke," \t %g",d[s]);
+		bytes += fprintf(file_ke,"\n");
+		break;
+		
+	case DiagJob::AVERAGES:
+	case DiagJob::ENSEMBLE:
+		{
+			FILE *file = (job->type==DiagJob::AVERAGES)?file_avg:file_ens;
+			int nf = (job->type==DiagJob::AVERAGES)?12:14;
+			if(BINARY_OUTPUT)
+			{
+				bytes += sizeof(double)*fwrite(&job->time, sizeof(double), 1, file);
+				bytes += sizeof(double)*fwrite(d, sizeof(double), nf*n, file);
+				break;
+			}
+			for(int i=0; i<n; i++)
+			{
+				bytes += fprintf(file,"%g", NodeX(i));
+				for(int f=0; f<nf; f++)
+					bytes += fprintf(file," \t %g", d[f*n+i]);
+				bytes += fprintf(file,"\n");
+			}
+		}
+		break;
+		
+	case DiagJob::PHASE_SPACE:
+		{
+			/*single precision is plenty for counts; packed in place into 
+			the front of the staging buffer, each float over doubles already read*/
+			char *buf = (char*)d;
+			for(int k=0; k<n; k++)
+			{
+				float count = d[k];
+				memcpy(buf+k*sizeof(float), &count, sizeof(float));
+			}
+			bytes += sizeof(double)*fwrite(&job->time, sizeof(double), 1, file_ps);
+			bytes += sizeof(float)*fwrite(buf, sizeof(float), n, file_ps);
+		}
+		break;
+		
+	case DiagJob::FLUSH:
+		fflush(file_res);
+		fflush(file_ke);
+		if(file_avg) fflush(file_avg);
+		if(file_ps) fflush(file_ps);
+		if(file_ens) fflush(file_ens);
+		break;
+	}
+	
+	bytes_written += bytes;
+}
+
+void DiagWriter::AllocStaging(size_t doubles)
+{
+	for(auto &job:jobs)
+	{
+		job.data = arena.Take<double>(doubles);
+		job.capacity = doubles;
+	}
+}
+
+void DiagWriter::Start(bool async)
+{
+	this->async = async;
+	stop = false;
+	num_free = STAGING_BUFFERS;
+	num_pending = head = 0;
+	for(int k=0; k<STAGING_BUFFERS; k++)
+		free_jobs[k] = &jobs[k];
+	if(async) worker = std::thread(&DiagWriter::Run, this);
+}
+
+DiagJob *DiagWriter::Acquire()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	cond.wait(guard, [this]{return num_free>0;});
+	return free_jobs[--num_free];
+}
+
+void DiagWriter::Submit(DiagJob *job)
+{
+	/*only rank 0 writes, the other ranks recycle the buffer*/
+	if(decomp.rank>0)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		free_jobs[num_free++] = job;
+		return;
+	}
+	
+	if(!async)
+	{
+		WriteJob(job);
+		std::lock_guard<std::mutex> guard(lock);
+		free_jobs[num_free++] = job;
+		return;
+	}
+	
+	std::lock_guard<std::mutex> guard(lock);
+	pending[(head+num_pending)%STAGING_BUFFERS] = job;
+	num_pending++;
+	cond.notify_all();
+}
+
+/*Writer thread: serialize the pending jobs in order, then recycle the buffers*/
+void DiagWriter::Run()
+{
+	while(true)
+	{
+		DiagJob *job;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait(guard, [this]{return num_pending>0 || stop;});
+			if(num_pending==0) return;
+			job = pending[head];
+		}
+		
+		WriteJob(job);
 		
-		// Add to the list
-		species->add(Particle(x,v));
+		std::lock_guard<std::mutex> guard(lock);
+		head = (head+1)%STAGING_BUFFERS;
+		num_pending--;
+		free_jobs[num_free++] = job;
+		cond.notify_all();
 	}
 }
 
-/*Sample Velocity (According to Birdsall)*/
-double SampleVel(double T, double mass)
-{
-	double v_th = sqrt(2*K*T/mass);
-	return v_th*sqrt(2)*(rnd()+rnd()+rnd()-1.5);
-}
-
-/*Covert the physical coordinate to the logical coordinate*/
-double XtoL(double pos)
+void DiagWriter::Finish()
 {
-	double li = (pos-domain.x0)/domain.dx;
-	return li;
+	if(!async) return;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+		cond.notify_all();
+	}
+	worker.join();
 }
 
-/*scatter the particle data to the mesh and collect the densities at the mesh */
-void scatter(double lc, double value, double *field)
+/*Quantities watched by the steady state detector: delta_phi, then the 
+particle count and the kinetic energy of each species*/
+void MonitorValues(vector<Species> &species_list, double *phi, double *q)
 {
-	int i = (int)lc;
-	double di = lc-i;
-	field[i] += value*(1-di);
-	field[i+1] += value*(di); 
+	q[0] = DeltaPhi(phi);
+	for(size_t s=0; s<species_list.size(); s++)
+	{
+		q[1+2*s] = species_list[s].part_list.size();
+		decomp.Sum(&q[1+2*s], 1);
+		q[2+2*s] = ComputeKE(&species_list[s]);
+	}
 }
 
-/* Gather field values at logical coordinates*/
-double gather(double lc, double *field)
+int64_t LiveMonitor::NowMs()
 {
-	int i=(int)lc;
-	double di = lc-i;
-	double val = field[i]*(1-di) + field[i+1]*(di);
-	return val;
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec*1000 + t.tv_nsec/1000000;
 }
 
-/*Scatter the particles to the mesh for evaluating densities*/
-void ScatterSpecies(Species *species, double *field)
+bool LiveMonitor::Open(const string &name, vector<Species> &species_list)
 {
-	/*clear the field*/
-	memset(field,0,sizeof(double)*domain.ni);
+	this->name = name;
+	ns = species_list.size();
+	int nodes = min(MONITOR_NODES, domain.ng);
+	sample.resize(nodes);
+	for(int k=0; k<nodes; k++)
+		sample[k] = nodes>1?(int)((long)k*(domain.ng-1)/(nodes-1)):0;
+	values.resize(1+2*ns);
+	global.resize(domain.ng);
+	if(decomp.rank!=0) return true;
 	
-	/*scatter particles to the mesh*/
-	for(auto &p:species->part_list)
+	int slot_doubles = 3 + 2*ns + PhaseTimer::NUM_PHASES+1 + 3*nodes;
+	size_t head = sizeof(Header) + 32*ns + sizeof(double)*nodes;
+	size_t data_offset = (head+4095)/4096*4096;
+	bytes = data_offset + (size_t)MONITOR_SLOTS*(sizeof(uint64_t)+sizeof(double)*slot_doubles);
+	
+	/*a fresh segment, zero filled by ftruncate*/
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_CREAT|O_RDWR, 0644);
+	void *map = MAP_FAILED;
+	if(fd>=0 && ftruncate(fd, bytes)==0)
+		map = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if(fd>=0) close(fd);
+	if(map==MAP_FAILED)
 	{
-		double lc = XtoL(p.pos);
-		scatter(lc,species->spwt,field);
+		printf("Unable to create the monitor segment %s\n", name.c_str());
+		shm_unlink(name.c_str());
+		return false;
 	}
 	
-	/*divide by cell volume*/
-	for(int i=0; i<domain.ni; i++)
-		field[i] /=domain.dx;
-	
-	field[0] *=2.0;
-	field[domain.ni-1] *= 2.0;
+	header = (Header*)map;
+	memcpy(header->magic, "PICSMON", 8);
+	header->version = VERSION;
+	header->slots = MONITOR_SLOTS;
+	header->slot_doubles = slot_doubles;
+	header->nodes = nodes;
+	header->ns = ns;
+	header->nphases = PhaseTimer::NUM_PHASES;
+	header->data_offset = data_offset;
+	header->dt = DT;
+	char *names = (char*)(header+1);
+	for(int s=0; s<ns; s++)
+		strncpy(names+32*s, species_list[s].name.c_str(), 31);
+	double *x = (double*)(names+32*ns);
+	for(int k=0; k<nodes; k++)
+		x[k] = NodeX(sample[k]);
+	__atomic_store_n(&header->running, 1, __ATOMIC_RELEASE);
+	printf("Monitor: %s, %i nodes, %i slots\n", name.c_str(), nodes, MONITOR_SLOTS);
+	return true;
 }
 
-/*Scatter the particles to the mesh for evaluating velocities*/
-void ScatterSpeciesVel(Species *species, double *field)
+void LiveMonitor::Close()
+{
+	if(header==NULL) return;
+	__atomic_store_n(&header->running, 0, __ATOMIC_RELEASE);
+	munmap(header, bytes);
+	shm_unlink(name.c_str());
+	header = NULL;
+}
+
+bool LiveMonitor::Subscribed()
+{
+	double fresh = 0;
+	if(header) fresh = (NowMs()-__atomic_load_n(&header->heartbeat, __ATOMIC_ACQUIRE) < HEARTBEAT_MS);
+	decomp.Broadcast(&fresh, 1);
+	return fresh>0;
+}
+
+/*Writes the slot between a zero and the new sequence number, so a reader 
+catching it half written sees the change*/
+void LiveMonitor::Publish(int ts, double time, vector<Species> &species_list, double *phi)
 {
-	/*clear the field*/
-	memset(field,0,sizeof(double)*domain.ni);
+	MonitorValues(species_list, phi, values.data());
 	
-	/*scatter particles to the mesh*/
-	for(auto &p:species->part_list)
+	uint64_t seq = 0, *slot_seq = NULL;
+	double *d = NULL;
+	int nodes = sample.size();
+	if(header)
 	{
-		double lc = XtoL(p.pos);
-		scatter(lc,species->spwt*p.vel,field);
+		seq = header->seq+1;
+		char *slot = (char*)header + SlotOffset(header, seq);
+		slot_seq = (uint64_t*)slot;
+		d = (double*)(slot_seq+1);
+		__atomic_store_n(slot_seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
 	
-	/*divide by cell volume*/
-	for(int i=0; i<domain.ni; i++)
-		field[i] /=domain.dx;
+	/*every rank takes part in the gathers*/
+	double *fields[] = {phi, domain.ndi, domain.nde};
+	int profiles = 3+2*ns+PhaseTimer::NUM_PHASES+1;
+	for(int f=0; f<3; f++)
+	{
+		decomp.Gather(fields[f], global.data());
+		for(int k=0; d && k<nodes; k++)
+			d[profiles+f*nodes+k] = global[sample[k]];
+	}
+	if(d==NULL) return;
 	
-	field[0] *=2.0;
-	field[domain.ni-1] *= 2.0;
+	d[0] = ts;
+	d[1] = time;
+	d[2] = values[0];
+	for(int s=0; s<ns; s++)
+	{
+		d[3+s] = values[1+2*s];
+		d[3+ns+s] = values[2+2*s];
+	}
+	for(int ph=0; ph<PhaseTimer::NUM_PHASES; ph++)
+		d[3+2*ns+ph] = timer.total[ph];
+	d[3+2*ns+PhaseTimer::NUM_PHASES] = timer.pushes_total;
+	__atomic_store_n(slot_seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&header->seq, seq, __ATOMIC_RELEASE);
 }
 
-//*******************************************************
-void PushSpecies(Species *species, double *ef)
+/*Wait for the segment, then keep the heartbeat fresh and print each record 
+until the run closes it*/
+int LiveMonitor::View(const string &name)
 {
-	// compute charge to mass ratio
-	double qm = species->charge/species->mass; 
-	list<Particle>::iterator it = species->part_list.begin();
+	if(name.empty())
+	{
+		printf("monitor_view needs the segment name in monitor_shm\n");
+		return 1;
+	}
+	/*the run may not have created or filled in the segment yet*/
+	Header *h = NULL;
+	off_t size = 0;
+	bool waiting = false;
+	while(true)
+	{
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd>=0)
+		{
+			size = lseek(fd, 0, SEEK_END);
+			void *map = MAP_FAILED;
+			if(size>=(off_t)sizeof(Header))
+				map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if(map!=MAP_FAILED)
+			{
+				h = (Header*)map;
+				if(__atomic_load_n(&h->running, __ATOMIC_ACQUIRE) || h->seq>0) break;
+				munmap(map, size);
+				h = NULL;
+			}
+		}
+		if(!waiting) printf("Waiting for %s\n", name.c_str());
+		waiting = true;
+		usleep(200000);
+	}
+	if(strncmp(h->magic, "PICSMON", 8)!=0 || h->version!=VERSION)
+	{
+		printf("%s is not a version %i monitor segment\n", name.c_str(), VERSION);
+		munmap(h, size);
+		return 1;
+	}
 	
-	// loop over particles
-	while (it!=species->part_list.end())
+	int ns = h->ns, nphases = h->nphases;
+	const char *names = (const char*)(h+1);
+	const char *phase_names[] = {"scatter", "rho", "solve", "ef", "push", "sort", "collide", "io"};
+	vector<double> d(h->slot_doubles);
+	uint64_t last = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+	while(true)
 	{
-		// grab a reference to the pointer
-		Particle &part = *it; 
-		
-		// compute particle node position
-		double lc = XtoL(part.pos);
-		
-		// gather electric field onto particle position
-		double part_ef = gather(lc,ef);
-		
-		// advance velocity
-		part.vel += DT*qm*part_ef;
-
-		// Advance particle position 
-		part.pos += DT*part.vel; 
-
-		// Remove the particles leaving the domain
-		if(part.pos < domain.x0 || part.pos >= domain.xmax)
+		__atomic_store_n(&h->heartbeat, NowMs(), __ATOMIC_RELEASE);
+		bool running = __atomic_load_n(&h->running, __ATOMIC_ACQUIRE);
+		uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		for(uint64_t n=max(last+1, seq>(uint64_t)h->slots?seq-h->slots+1:1); n<=seq; n++)
 		{
-			it = species->part_list.erase(it);
-			
-			/* Encountering Steady state*/
-			//part.pos = (domain.xl - domain.x0)/2; // relocate the particle in the middle of the domain
-			//part.pos = domain.x0 + rnd()*(domain.ni - 1)*domain.dx;
-			//cout << (domain.x0+(domain.ni/100)*domain.dx) << endl;
-			//part.pos = (domain.x0+(domain.ni/100)*domain.dx) + rnd()*domain.xl-((domain.ni/100)*domain.dx);
-			//part.vel = SampleVel(species->Temp*EV_TO_K, species->mass);
-			//species->add(Particle(part.pos,part.vel));
+			const char *slot = (const char*)h + SlotOffset(h, n);
+			const uint64_t *slot_seq = (const uint64_t*)slot;
+			if(__atomic_load_n(slot_seq, __ATOMIC_ACQUIRE)!=n) continue;
+			memcpy(d.data(), slot_seq+1, sizeof(double)*d.size());
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(slot_seq, __ATOMIC_RELAXED)!=n) continue;
 			
-			continue;
+			double run_time = 0;
+			int slowest = 0;
+			for(int ph=0; ph<nphases; ph++)
+			{
+				run_time += d[3+2*ns+ph];
+				if(d[3+2*ns+ph]>d[3+2*ns+slowest]) slowest = ph;
+			}
+			printf("TS: %i \t t: %.4g s \t delta_phi: %.3g", (int)d[0], d[1], d[2]);
+			for(int s=0; s<ns; s++)
+				printf(" \t %.31s: %.0f, KE %.3g", names+32*s, d[3+s], d[3+ns+s]);
+			printf(" \t %.3g pushes/s, %.0f%% %s\n", run_time>0?d[3+2*ns+nphases]/run_time:0, 
+				run_time>0?100*d[3+2*ns+slowest]/run_time:0, slowest<8?phase_names[slowest]:"?");
 		}
-		else
-			it++;			
+		fflush(stdout);
+		last = max(last, seq);
+		if(!running && seq==last) break;
+		usleep(100000);
 	}
+	munmap(h, size);
+	return 0;
 }
-//*********************************************************
-/*Rewind particle velocities by -0.5*DT */
-void RewindSpecies(Species *species, double *ef)
+
+/*Largest potential of the whole domain less the potential of the left wall*/
+double DeltaPhi(double *phi)
 {
-	// compute charge to mass ratio
-	double qm = species->charge/species->mass; 
-	for(auto &p:species->part_list)
+	double max_phi = phi[0];
+	for(int i=0; i<domain.ni; i++)
+		if (phi[i]>max_phi) max_phi=phi[i];
+	double phi_wall = phi[0];
+	decomp.Max(&max_phi, 1);
+	decomp.Broadcast(&phi_wall, 1);
+	return max_phi-phi_wall;
+}
+
+double ComputeKE(Species *species)
+{
+	double ke = 0;
+	ParticleArray &part = species->part_list;
+	#pragma omp parallel for reduction(+:ke)
+	for (int p=0; p<part.size(); p++)
 	{
-		// compute particle node position
-		double lc = XtoL(p.pos);
-		// gather electric field onto the particle position
-		double part_ef = gather(lc,ef);
-		//advance velocity
-		p.vel -= 0.5*DT*qm*part_ef;
+		ke += part.vel[p]*part.vel[p];
 	}
+	decomp.Sum(&ke, 1);
+	
+	/*Multiply 0.5*mass for all particles*/
+	ke *= 0.5*(species->spwt*species->mass);
+	
+	/*Convert the kinetic energy in eV units*/
+	ke /= QE;
+	return ke;
 }
+ 
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/************************** ENSEMBLE ******************************/
 
-/* Compute the charge densities */
-void ComputeRho(Species *ions, Species *electrons)
+void Ensemble::Column(Field f, int m, double *dst)
 {
-	double *rho = domain.rho;
-	memset(rho,0,sizeof(double)*domain.ni);
-	
+	const double *src = fields[f];
 	for(int i=0; i<domain.ni; i++)
-		rho[i]=ions->charge*domain.ndi[i] + electrons->charge*domain.nde[i];
-	
-	/*Reduce numerical noise by setting the densities to zero when less than 1e8/m^3*/
-	if(false){
+		dst[i] = src[(size_t)i*nm+m];
+}
+
+void Ensemble::SetColumn(Field f, int m, const double *src)
+{
+	double *dst = fields[f];
 	for(int i=0; i<domain.ni; i++)
-		if(fabs(rho[i])<1e8*QE) rho[i]=0;
-	}
+		dst[(size_t)i*nm+m] = src[i];
 }
 
-/* Potential Solver: 1. Gauss-Seidel 2. Direct-Solver*/
-bool SolvePotential(double *phi, double *rho)
+size_t Ensemble::ArenaBytes(int ni, int members)
+{
+	return NUM_FIELDS*Arena::Bytes<double>((size_t)ni*members) + Arena::Bytes<double>(ni);
+}
+
+void Ensemble::Init(const vector<SpeciesInput> &species_input, int members)
 {
-	double L2;
-	double dx2 = domain.dx*domain.dx;
+	nm = members;
+	int ni = domain.ni;
+	for(int f=0; f<NUM_FIELDS; f++)
+		fields[f] = arena.Take<double>((size_t)ni*nm);
+	column = arena.Take<double>(ni);
+	species.resize(nm);
+	streams.resize(nm);
+	vector<string> values = Split(ENSEMBLE_VALUES, ',');
 	
-	// Initialize boundaries
-	phi[0]=phi[domain.ni-1]=0;
+	for(int m=0; m<nm; m++)
+	{
+		if(!ENSEMBLE_PARAM.empty()) SetParam(ENSEMBLE_PARAM, values[m]);
+		CreateSpecies(species_input, species[m]);
+		if(m==0 && MCC) mcc.Init(species[0]);
+		InitRandomStreams(omp_get_max_threads(), ENSEMBLE_PARAM.empty()?SEED+m:SEED);
+		
+		/*load the member and solve its initial field on the domain 
+		arrays, as the single run does*/
+		vector<Species> &species_list = species[m];
+		for(auto &sp:species_list)
+			::Init(&sp);
+		for(auto &sp:species_list)
+			ScatterSpecies(&sp,sp.den.data());
+		SumSpeciesMoments(species_list);
+		ComputeRho(species_list);
+		memset(domain.phi,0,sizeof(double)*ni);
+		SolvePotential(domain.phi, domain.rho);
+		ComputeEF(domain.phi, domain.ef);
+		for(auto &sp:species_list)
+			RewindSpecies(&sp,domain.ef);
+		streams[m].swap(rng_streams);
+		
+		double *domain_fields[] = {domain.ndi, domain.nde, domain.rho, domain.veli, domain.vele, domain.phi, domain.ef};
+		for(int f=0; f<NUM_FIELDS; f++)
+			SetColumn((Field)f, m, domain_fields[f]);
+	}
+}
+
+void Ensemble::ComputeMoments(int ts)
+{
+	int ni = domain.ni;
+	for(int f=NDI; f<=VELE; f++)
+		memset(fields[f], 0, sizeof(double)*ni*nm);
 	
-	// Main Solver
-	for(int it=0; it<200000; it++)
+	/*same order of the sums as SumSpeciesMoments and ComputeRho*/
+	for(int m=0; m<nm; m++)
 	{
-		for(int i=1; i<domain.ni-1; i++)
+		for(auto &sp:species[m])
 		{
-			double g = 0.5*(phi[i-1] + phi[i+1] + dx2*rho[i]/EPS);
-			phi[i]=phi[i] + 1.4*(g-phi[i]);
+			if(ts%sp.subcycle==0)
+				ScatterSpeciesMoments(&sp, sp.den.data(), sp.vel.data());
+			
+			double *nd = fields[(sp.charge>0)?NDI:NDE];
+			double *vel = fields[(sp.charge>0)?VELI:VELE];
+			double *rho = fields[RHO];
+			for(int i=0; i<ni; i++)
+			{
+				size_t k = (size_t)i*nm+m;
+				nd[k] += sp.den[i];
+				vel[k] += sp.vel[i];
+				rho[k] += sp.charge*sp.den[i];
+			}
 		}
-		// Check for convergence
-		if(it%25==0)
+	}
+}
+
+void Ensemble::Push(int ts)
+{
+	int ni = domain.ni;
+	for(int m=0; m<nm; m++)
+	{
+		rng_streams.swap(streams[m]);
+		Column(EF, m, column);
+		for(size_t s=0; s<species[m].size(); s++)
 		{
-			double sum = 0;
-			for(int i=1; i<domain.ni-1; i++)
+			Species &sp = species[m][s];
+			
+			/*subcycled species: accumulate the field, push at the end of 
+			the cycle in the averaged field*/
+			double *sp_ef = column;
+			if(sp.subcycle>1)
 			{
-				double R = -rho[i]/EPS - (phi[i-1]-2*phi[i]+phi[i+1])/dx2;
-				sum += R*R;
+				double *ef_sum = sp.ef_sum.data();
+				for(int i=0; i<ni; i++) ef_sum[i] += column[i];
+				if(ts%sp.subcycle!=sp.subcycle-1) continue;
+				for(int i=0; i<ni; i++) ef_sum[i] /= sp.subcycle;
+				sp_ef = ef_sum;
 			}
-			L2 = sqrt(sum)/domain.ni;
-			if(L2<1e-4){return true;}
 			
+			int np = sp.part_list.size();
+			timer.CountPushes(np);
+			PushSpecies(&sp, sp_ef);
+			if(sp.subcycle>1) sp.ef_sum.assign(ni,0);
+			if(MCC) mcc.Collide(&sp, s);
+			if(SOURCE) InjectSpecies(&sp, np-sp.part_list.size());
 		}
-		//printf("GS-Converged! L2=%g\n",L2);
+		rng_streams.swap(streams[m]);
 	}
-	printf("Gauss-Siedel solver failed to converge, L2=%g\n",L2);
-	return false;
 }
 
-/* Potential Direct Solver */
-
-bool SolvePotentialDirect(double *x, double *rho)
+void Ensemble::Write(int ts, double time, double *delta_phi, double *delta_phi_std)
 {
-	/* Set coefficients, precompute them*/
 	int ni = domain.ni;
-	double dx2 = domain.dx*domain.dx;
-	double *a = new double[ni];
-	double *b = new double[ni];
-	double *c = new double[ni];
 	
-	/*Centtral difference on internal nodes*/
-	for(int i=1; i<ni-1; i++)
+	/*mean and (sample) variance over the members of each node*/
+	DiagJob *job = diag_writer.Acquire();
+	job->type = DiagJob::ENSEMBLE;
+	job->time = ts*DT;
+	job->n = ni;
+	job->Stage(2*NUM_FIELDS*ni);
+	for(int f=0; f<NUM_FIELDS; f++)
 	{
-		a[i] = 1; b[i] = -2; c[i] = 1;
+		double *mean = &job->data[2*f*ni], *var = &job->data[(2*f+1)*ni];
+		for(int i=0; i<ni; i++)
+		{
+			const double *v = &fields[f][(size_t)i*nm];
+			double sum = 0, sum2 = 0;
+			for(int m=0; m<nm; m++)
+				sum += v[m];
+			mean[i] = sum/nm;
+			for(int m=0; m<nm; m++)
+				sum2 += (v[m]-mean[i])*(v[m]-mean[i]);
+			var[i] = nm>1?sum2/(nm-1):0;
+		}
 	}
+	diag_writer.Submit(job);
 	
-	/*Apply dirichlet boundary conditions on boundaries*/
-	a[0]=0; b[0]=1; c[0]=0;
-	a[ni-1]=0; b[ni-1]=1; c[ni-1]=0;
+	job = diag_writer.Acquire();
+	job->type = DiagJob::KE;
+	job->time = time;
+	job->n = species[0].size();
+	job->Stage(species[0].size());
+	memset(job->data, 0, sizeof(double)*species[0].size());
+	for(int m=0; m<nm; m++)
+		for(size_t s=0; s<species[m].size(); s++)
+			job->data[s] += ComputeKE(&species[m][s])/nm;
+	diag_writer.Submit(job);
 	
-	/*multiply R.H.S.*/
-	for (int i=1; i<ni-1; i++)
-		x[i]=-rho[i]*dx2/EPS;
+	double sum = 0, sum2 = 0;
+	for(int m=0; m<nm; m++)
+	{
+		Column(PHI, m, column);
+		double dphi = DeltaPhi(column);
+		sum += dphi;
+		sum2 += dphi*dphi;
+	}
+	*delta_phi = sum/nm;
+	*delta_phi_std = nm>1?sqrt(max(0.0, (sum2-sum*sum/nm)/(nm-1))):0;
+}
+
+/*Run the ensemble: the loop of main over all members at once, writing the 
+ensemble mean and variance profiles to ensemble.dat and the mean kinetic 
+energies to ke.dat*/
+int RunEnsemble(vector<SpeciesInput> &species_input)
+{
+	InitDomain(NC, DX);
+	field_solver.Init(domain.ni, domain.dx);
+	printf("Field solver: direct, batched over %i members\n", ENSEMBLE);
+	AllocThreadGrids();
+	printf("Threads: %i\n", omp_get_max_threads());
+	const char *kernel_name;
+	push_kernel = SelectPushKernel(PUSH_KERNEL.c_str(), SHAPE_ORDER, &kernel_name);
+	printf("Push kernel: %s, shape order %i\n", kernel_name, SHAPE_ORDER);
 	
-	x[0] = 0;
-	x[ni-1] = 0;
+	Ensemble ensemble;
+	ensemble.Init(species_input, ENSEMBLE);
+	vector<Species> &species_list = ensemble.species[0];
+	if(ENSEMBLE_PARAM.empty())
+		printf("Ensemble: %i members, seeds %i to %i\n", ENSEMBLE, SEED, SEED+ENSEMBLE-1);
+	else
+		printf("Ensemble: %i members, %s = %s\n", ENSEMBLE, ENSEMBLE_PARAM.c_str(), ENSEMBLE_VALUES.c_str());
 	
-	/*Modify the coefficients*/
-	c[0] /=b[0];
-	x[0] /=b[0];
+	const char *ens_names[] = {"ndi","ndi_var","nde","nde_var","rho","rho_var","veli","veli_var",
+		"vele","vele_var","phi","phi_var","ef","ef_var"};
+	vector<const char*> ke_names;
+	for(auto &sp:species_list)
+		ke_names.push_back(sp.name.c_str());
+	vector<double> x_nodes(domain.ni);
+	for(int i=0; i<domain.ni; i++)
+		x_nodes[i] = i*domain.dx;
+	string ens_name = OUTPUT_PREFIX + (BINARY_OUTPUT?"ensemble.bin":"ensemble.dat");
+	string ke_name = OUTPUT_PREFIX + (BINARY_OUTPUT?"ke.bin":"ke.dat");
+	file_ens = OpenOutput(ens_name.c_str(), "PICSENS", domain.ni, 14, ens_names, x_nodes.data());
+	file_ke = OpenOutput(ke_name.c_str(), "PICSKE", 1, ke_names.size(), ke_names.data(), NULL);
+	diag_writer.Start(ASYNC_OUTPUT);
+	timer.Start();
 	
-	for(int i=1; i<ni; i++)
+	double Time = 0;
+	int num_dumps = 0;
+	double *phi = ensemble.fields[Ensemble::PHI];
+	double *rho = ensemble.fields[Ensemble::RHO];
+	double *ef = ensemble.fields[Ensemble::EF];
+	for(int ts=0; ts<NUM_TS+1; ts++)
 	{
-		double id = (b[i]-c[i-1]*a[i]);
-		c[i] /= id;
-		x[i] = (x[i]-x[i-1]*a[i])/id;
+		ensemble.ComputeMoments(ts);
+		timer.Lap(PhaseTimer::SCATTER);
+		field_solver.SolveBatch(phi, rho, ENSEMBLE);
+		timer.Lap(PhaseTimer::SOLVE);
+		ComputeEFBatch(phi, ef, ENSEMBLE);
+		timer.Lap(PhaseTimer::EF);
+		ensemble.Push(ts);
+		timer.Lap(PhaseTimer::PUSH);
+		
+		if(ts%DIAG_INTERVAL==0)
+		{
+			double delta_phi, delta_phi_std;
+			ensemble.Write(ts, Time, &delta_phi, &delta_phi_std);
+			printf("TS: %i \t delta_phi: %.3g +- %.2g\n", ts, delta_phi, delta_phi_std);
+			num_dumps++;
+			if(FLUSH_INTERVAL>0 && num_dumps%FLUSH_INTERVAL==0)
+				FlushOutput();
+			timer.Lap(PhaseTimer::IO);
+		}
+		Time += DT;
 	}
 	
-	/* Now back substitute */
-	for(int i=ni-2; i>=0; i--)
-		x[i] = x[i] - c[i]*x[i+1];
+	diag_writer.Finish();
+	fclose(file_ens);
+	fclose(file_ke);
+	file_ens = file_ke = NULL;
+	timer.Lap(PhaseTimer::IO);
+	if(MCC) mcc.Report(species_list);
 	
-	return true;
+	double run_time = 0;
+	for(int ph=0; ph<PhaseTimer::NUM_PHASES; ph++)
+		run_time += timer.total[ph];
+	printf("Run time: %.3g s, %.3g particle pushes/s, %.3g MB written\n", run_time, 
+		timer.pushes_total/run_time, bytes_written/1e6);
+	
+	FreeDomain();
+	return 0;
 }
+ 
+/*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/************************* BENCHMARKS *****************************/
 
-/*Compute electric field (differentiating potential)*/
-void ComputeEF(double *phi, double *ef)
+/*Load np electrons, uniform in space and Maxwellian in velocity. Drawn 
+serially from the first stream, so the particles and the checksums do not 
+depend on the number of threads*/
+void BenchLoad(Species *species, int np)
 {
-	/*Apply central difference to the inner nodes*/
-	for(int i=1; i<domain.ni-1; i++)
-		ef[i] = -(phi[i+1]-phi[i-1])/(2*domain.dx);
-	
-	/*Apply one sided difference at the boundary nodes*/
-	ef[0] = -(phi[1]-phi[0])/domain.dx;
-	ef[domain.ni-1] = -(phi[domain.ni-1]-phi[domain.ni-2])/domain.dx;
+	ParticleArray &part = species->part_list;
+	part.resize(np);
+	RandomStream &rng = rng_streams[0];
+	double v_th = sqrt(K*species->Temp*EV_TO_K/species->mass);
+	double u[RandomStream::BATCH], g[RandomStream::BATCH];
+	for(int b=0; b<np; b+=RandomStream::BATCH)
+	{
+		int n = min(RandomStream::BATCH, np-b);
+		rng.Fill(u, n);
+		rng.FillNormal(g, n);
+		for(int k=0; k<n; k++)
+		{
+			part.pos[b+k] = domain.x0 + u[k]*domain.xl;
+			part.vel[b+k] = v_th*g[k];
+			part.id[b+k] = b+k;
+		}
+	}
+}
+
+/*Sum of absolute values, an order independent checksum*/
+template<class T> double BenchChecksum(const T *data, size_t n)
+{
+	double sum = 0;
+	for(size_t i=0; i<n; i++)
+		sum += fabs(data[i]);
+	return sum;
 }
 
+double BenchSeconds(std::chrono::steady_clock::time_point t0)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+}
 
-/*Write the output with time*/
-void Write_ts(int ts)
+/*Print a result and append it to the benchmark log*/
+void BenchReport(FILE *file, const char *kernel, const char *variant, long np, int nc, 
+	double seconds, double items, double bytes)
 {
-	//double *gamma_i  = new double[domain.ni];
-	//double *gamma_e = new double[domain.ni];
-	
+	printf("%-10s %-8s np=%-10li nc=%-8i %10.3f ns/item %8.3g GB/s\n", kernel, variant, np, nc, 
+		1e9*seconds/items, bytes/seconds/1e9);
+	fprintf(file,"{\"kernel\": \"%s\", \"variant\": \"%s\", \"np\": %li, \"nc\": %i, "
+		"\"seconds\": %.6e, \"ns_per_item\": %.6e, \"gb_per_s\": %.6e}\n", kernel, variant, 
+		np, nc, seconds, 1e9*seconds/items, bytes/seconds/1e9);
+}
+
+/*Compare a checksum against the reference, relative tolerance tol*/
+bool BenchCheck(const char *name, double value, double ref, double tol)
+{
+	bool ok = fabs(value-ref) <= tol*fabs(ref);
+	if(!ok) printf("CHECK FAILED %s: %.15e, reference %.15e\n", name, value, ref);
+	return ok;
+}
+
+/*Push, rewind and scatter for np particles on nc cells. Every vector push 
+kernel is checked against the scalar push from the same initial state*/
+bool BenchParticles(FILE *file, int np, int nc, map<string,double> &sums)
+{
+	bool ok = true;
+	InitDomain(nc, DX);
+	AllocThreadGrids();
+	InitRandomStreams(omp_get_max_threads(), 0);
 	for(int i=0; i<domain.ni; i++)
+		domain.ef[i] = 1e3*sin(2*pi*i/(domain.ni-1));
+	
+	Species electrons("Electrons", ME, -QE, PLASMA_DEN*domain.xl/np, np, ELECTRON_TEMP);
+	BenchLoad(&electrons, np);
+	ParticleArray &part = electrons.part_list;
+	vector<PartReal> pos0 = part.pos, vel0 = part.vel;
+	vector<int> id0 = part.id;
+	
+	/*push kernels*/
+	const char *variants[] = {"scalar", "avx2", "avx512"};
+	double ref_pos = 0, ref_vel = 0;
+	double push_tol = sizeof(PartReal)<sizeof(double)?1e-6:1e-12; // fma contraction in single
+	for(int k=0; k<3; k++)
 	{
-		//gamma_i[i] = domain.ndi[i]*domain.veli[i];
-		//gamma_e[i] = 0.25*domain.nde[i]*sqrt(8*K*ELECTRON_TEMP/pi*(9.1E-31));
-		fprintf(file_res,"%g \t %g \t %g \t %g \t %g \t %g \t %g \t %g\n", i*domain.dx, domain.ndi[i],
-	domain.nde[i], domain.rho[i], domain.veli[i], domain.vele[i], domain.phi[i], domain.ef[i]);
-			
+		const char *name;
+		push_kernel = SelectPushKernel(variants[k], SHAPE_ORDER, &name);
+		if(strcmp(name, variants[k])!=0) continue;
+		
+		double seconds = 0, pushed = 0;
+		for(int r=0; r<=BENCH_REPS; r++)
+		{
+			part.pos = pos0; part.vel = vel0; part.id = id0;
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			PushSpecies(&electrons, domain.ef);
+			if(r>0) {seconds += BenchSeconds(t0); pushed += np;}
+		}
+		
+		double sum_pos = BenchChecksum(part.pos.data(), part.size());
+		double sum_vel = BenchChecksum(part.vel.data(), part.size());
+		if(k==0) {ref_pos = sum_pos; ref_vel = sum_vel;}
+		ok &= BenchCheck("push_pos", sum_pos, ref_pos, push_tol);
+		ok &= BenchCheck("push_vel", sum_vel, ref_vel, push_tol);
+		BenchReport(file, "push", name, np, nc, seconds, pushed, (4.0*sizeof(PartReal)+1)*pushed);
+	}
+	sums["push_pos"] = ref_pos;
+	sums["push_vel"] = ref_vel;
+	
+	/*rewind*/
+	part.pos = pos0; part.vel = vel0; part.id = id0;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		RewindSpecies(&electrons, domain.ef);
+	BenchReport(file, "rewind", "", np, nc, BenchSeconds(t0), (double)BENCH_REPS*np, 3.0*sizeof(PartReal)*BENCH_REPS*np);
+	
+	/*scatter routines*/
+	part.pos = pos0; part.vel = vel0; part.id = id0;
+	t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		ScatterSpecies(&electrons, domain.nde);
+	BenchReport(file, "scatter", "den", np, nc, BenchSeconds(t0), (double)BENCH_REPS*np, 1.0*sizeof(PartReal)*BENCH_REPS*np);
+	sums["scatter_den"] = BenchChecksum(domain.nde, domain.ni);
+	
+	t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		ScatterSpeciesVel(&electrons, domain.vele);
+	BenchReport(file, "scatter", "vel", np, nc, BenchSeconds(t0), (double)BENCH_REPS*np, 2.0*sizeof(PartReal)*BENCH_REPS*np);
+	sums["scatter_vel"] = BenchChecksum(domain.vele, domain.ni);
+	
+	vector<double> den(domain.ni), vel(domain.ni);
+	t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		ScatterSpeciesMoments(&electrons, den.data(), vel.data());
+	BenchReport(file, "scatter", "moments", np, nc, BenchSeconds(t0), (double)BENCH_REPS*np, 2.0*sizeof(PartReal)*BENCH_REPS*np);
+	ok &= BenchCheck("moments_den", BenchChecksum(den.data(), domain.ni), sums["scatter_den"], 1e-12);
+	ok &= BenchCheck("moments_vel", BenchChecksum(vel.data(), domain.ni), sums["scatter_vel"], 1e-12);
+	
+#ifdef PICS_DEVICE
+	/*device push (with the removal of the leaving particles) and deposit, 
+	against the scalar push and the CPU deposit from the same initial state*/
+	field_solver.Init(domain.ni, domain.dx);
+	vector<Species> device_list(1, electrons);
+	ParticleArray &device_part = device_list[0].part_list;
+	double seconds = 0, pushed = 0;
+	for(int r=0; r<=BENCH_REPS; r++)
+	{
+		device_part.pos = pos0; device_part.vel = vel0; device_part.id = id0;
+		device.Init(device_list, field_solver);
+		t0 = std::chrono::steady_clock::now();
+		device.Push(0, 0);
+		if(r>0) {seconds += BenchSeconds(t0); pushed += np;}
+		if(r<BENCH_REPS) device.Free();
 	}
-	//fprintf(file_res,"%g \t %g \t %g\n",ts*DT, gamma_i[domain.ni-1], gamma_e[domain.ni-1]);
-	fflush(file_res);
+	device.Download(true);
+	ok &= BenchCheck("push_device_pos", BenchChecksum(device_part.pos.data(), device_part.size()), ref_pos, push_tol);
+	ok &= BenchCheck("push_device_vel", BenchChecksum(device_part.vel.data(), device_part.size()), ref_vel, push_tol);
+	BenchReport(file, "push", "device", np, nc, seconds, pushed, (4.0*sizeof(PartReal)+1)*pushed);
+	device.Free();
+	
+	device_part.pos = pos0; device_part.vel = vel0; device_part.id = id0;
+	device.Init(device_list, field_solver);
+	t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		device.ScatterMoments(0);
+	BenchReport(file, "scatter", "device", np, nc, BenchSeconds(t0), (double)BENCH_REPS*np, 2.0*sizeof(PartReal)*BENCH_REPS*np);
+	device.Download(false);
+	ok &= BenchCheck("moments_device_den", BenchChecksum(device_list[0].den.data(), domain.ni), sums["scatter_den"], 1e-12);
+	ok &= BenchCheck("moments_device_vel", BenchChecksum(device_list[0].vel.data(), domain.ni), sums["scatter_vel"], 1e-12);
+	device.Free();
+#endif
+	
+	FreeDomain();
+	return ok;
 }
 
-/* Write the Output results*/
-void Write_Particle(Species *species)
+/*Direct, cyclic reduction, multigrid and Gauss-Seidel field solves and the 
+field output on nc cells*/
+bool BenchGrid(FILE *file, int nc, map<string,double> &sums)
 {
-	for(auto& p: species->part_list)
-	{		
-		fprintf(file_res,"%g \t %g\n",p.pos, p.vel);
+	bool ok = true;
+	InitDomain(nc, DX);
+	field_solver.Init(domain.ni, domain.dx);
+	for(int i=0; i<domain.ni; i++)
+		domain.rho[i] = 1e15*QE*sin(pi*i/(domain.ni-1));
+	
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		SolvePotentialDirect(domain.phi, domain.rho);
+	BenchReport(file, "solve", "direct", 0, nc, BenchSeconds(t0), (double)BENCH_REPS*domain.ni, 
+		40.0*BENCH_REPS*domain.ni);
+	vector<double> phi_direct(domain.phi, domain.phi+domain.ni);
+	sums["solve_direct"] = BenchChecksum(domain.phi, domain.ni);
+	
+	t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		field_solver.SolvePCR(domain.phi, domain.rho);
+	BenchReport(file, "solve", "pcr", 0, nc, BenchSeconds(t0), (double)BENCH_REPS*domain.ni, 
+		64.0*BENCH_REPS*domain.ni*field_solver.Iterations());
+	/*both direct solves lose accuracy like the condition number, ni^2*/
+	double solve_tol = 1e-9 + 1e-16*domain.ni*domain.ni;
+	ok &= BenchCheck("solve_pcr_vs_direct", BenchChecksum(domain.phi, domain.ni), sums["solve_direct"], solve_tol);
+	
+#ifdef PICS_DEVICE
+	/*cyclic reduction on the device*/
+	vector<Species> no_species;
+	device.Init(no_species, field_solver);
+	t0 = std::chrono::steady_clock::now();
+	for(int r=0; r<BENCH_REPS; r++)
+		device.SolvePotential(field_solver);
+	BenchReport(file, "solve", "device", 0, nc, BenchSeconds(t0), (double)BENCH_REPS*domain.ni, 
+		64.0*BENCH_REPS*domain.ni*field_solver.Iterations());
+	device.Download(false);
+	ok &= BenchCheck("solve_device_vs_direct", BenchChecksum(domain.phi, domain.ni), sums["solve_direct"], solve_tol);
+	device.Free();
+#endif
+	
+	/*multigrid from a cold start, as the first solve of a run*/
+	double seconds = 0;
+	bool converged = true;
+	for(int r=0; r<BENCH_REPS; r++)
+	{
+		memset(domain.phi,0,sizeof(double)*domain.ni);
+		t0 = std::chrono::steady_clock::now();
+		converged &= field_solver.SolveMultigrid(domain.phi, domain.rho);
+		seconds += BenchSeconds(t0);
 	}
+	BenchReport(file, "solve", "multigrid", 0, nc, seconds, (double)BENCH_REPS*domain.ni, 
+		96.0*BENCH_REPS*domain.ni*field_solver.Iterations());
+	ok &= converged && BenchCheck("solve_multigrid_vs_direct", BenchChecksum(domain.phi, domain.ni), 
+		sums["solve_direct"], std::max(1e-6, solve_tol));
+	
+	if(nc<=BENCH_GS_NC_MAX)
+	{
+		seconds = 0;
+		converged = true;
+		for(int r=0; r<BENCH_REPS; r++)
+		{
+			memset(domain.phi,0,sizeof(double)*domain.ni);
+			t0 = std::chrono::steady_clock::now();
+			converged &= SolvePotential(domain.phi, domain.rho);
+			seconds += BenchSeconds(t0);
+		}
+		BenchReport(file, "solve", "gs", 0, nc, seconds, (double)BENCH_REPS*domain.ni, 
+			24.0*BENCH_REPS*domain.ni);
 		
-	fflush(file_res);
+		/*Gauss-Seidel stops at a residual, so only loosely matches the direct solve*/
+		if(converged)
+		{
+			sums["solve_gs"] = BenchChecksum(domain.phi, domain.ni);
+			ok &= BenchCheck("solve_gs_vs_direct", sums["solve_gs"], sums["solve_direct"], 1e-6);
+		}
+	}
+	
+	/*field output, text and binary, written synchronously to a scratch file*/
+	const char *res_names[] = {"ndi","nde","rho","veli","vele","phi","ef"};
+	bool binary = BINARY_OUTPUT;
+	for(int b=0; b<2; b++)
+	{
+		BINARY_OUTPUT = (b==1);
+		string name = OUTPUT_PREFIX + "bench_output.tmp";
+		file_res = OpenOutput(name.c_str(), "PICSRES", domain.ni, 7, res_names, domain.phi);
+		diag_writer.Start(false);
+		long bytes0 = bytes_written;
+		t0 = std::chrono::steady_clock::now();
+		for(int r=0; r<BENCH_REPS; r++)
+			Write_ts(r);
+		fclose(file_res);
+		double seconds = BenchSeconds(t0);
+		BenchReport(file, "write_ts", b?"binary":"text", 0, nc, seconds, (double)BENCH_REPS*domain.ni, 
+			(double)(bytes_written-bytes0));
+		remove(name.c_str());
+	}
+	BINARY_OUTPUT = binary;
+	
+	FreeDomain();
+	return ok;
 }
 
-void WriteKE(double Time, Species *ions, Species *electrons)
+/*Decades from min up to max, with max itself as the last entry*/
+vector<int> BenchSweep(int min, int max)
 {
-	double ke_ions = ComputeKE(ions);
-	double ke_electrons = ComputeKE(electrons);
-	fprintf(file_ke,"%g \t %g \t %g\n",Time, ke_ions,ke_electrons);
-	
-	fflush(file_ke);
+	vector<int> values;
+	for(double v=min; v<max*0.9999; v*=10)
+		values.push_back((int)v);
+	values.push_back(max);
+	return values;
 }
 
-double ComputeKE(Species *species)
+/*Benchmark the PIC kernels over particle counts and grid sizes, and check a 
+fixed reference case (seed 0, 1e5 particles, 400 cells) against the checksums 
+of the scalar code stored in BENCH_REF. The reference is written only when 
+asked for (bench_write_ref), a missing one fails the check*/
+int RunBenchmarks()
 {
-	double ke = 0;
-	for (auto &p:species->part_list)
+	bool ok = true;
+	string log_name = OUTPUT_PREFIX + "bench.jsonl";
+	FILE *file = fopen(log_name.c_str(),"w");
+	printf("Threads: %i\n", omp_get_max_threads());
+	
+	/*reference case*/
+	map<string,double> sums;
+	ok &= BenchParticles(file, 100000, 400, sums);
+	ok &= BenchGrid(file, 400, sums);
+	
+	/*the reference comes from the double precision code, single precision 
+	particles only match it to rounding*/
+	double ref_tol = sizeof(PartReal)<sizeof(double)?1e-5:1e-9;
+	ifstream ref_in(BENCH_REF);
+	if(BENCH_WRITE_REF)
 	{
-		ke += p.vel*p.vel;
+		FILE *ref_out = fopen(BENCH_REF.c_str(),"w");
+		for(auto &sum:sums)
+			fprintf(ref_out,"%s %.17g\n", sum.first.c_str(), sum.second);
+		fclose(ref_out);
+		printf("Reference %s written\n", BENCH_REF.c_str());
+	}
+	else if(ref_in.is_open())
+	{
+		string name;
+		double ref;
+		while(ref_in >> name >> ref)
+		{
+			if(sums.count(name)==0) continue;
+			ok &= BenchCheck(name.c_str(), sums[name], ref, ref_tol);
+		}
+		printf("Reference %s: %s\n", BENCH_REF.c_str(), ok?"passed":"FAILED");
+	}
+	else
+	{
+		ok = false;
+		printf("Reference %s missing, write it with bench_write_ref=true\n", BENCH_REF.c_str());
 	}
-	/*Multiply 0.5*mass for all particles*/
-	ke += 0.5*(species->spwt*species->mass);
 	
-	/*Convert the kinetic energy in eV units*/
-	ke /= QE;
-	return ke;
+	/*particle count sweep*/
+	for(int np:BenchSweep(BENCH_NP_MIN, BENCH_NP_MAX))
+		ok &= BenchParticles(file, np, 400, sums);
+	
+	/*grid size sweep*/
+	for(int nc:BenchSweep(BENCH_NC_MIN, BENCH_NC_MAX))
+	{
+		ok &= BenchGrid(file, nc, sums);
+		ok &= BenchParticles(file, BENCH_NP_MIN, nc, sums);
+	}
+	
+	fclose(file);
+	printf("Benchmarks %s\n", ok?"passed":"FAILED");
+	return ok?0:1;
 }
- 
\ No newline at end of file